@@ -1,8 +1,17 @@
 #include "Assumption.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/ConstantRange.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
 
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <algorithm>
 
 using namespace llvm;
 /***************************************
@@ -11,8 +20,8 @@ using namespace llvm;
 
 void Assumption::update_assumption(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params) {
     bool dispatch = holds(gridX, gridY, gridZ, blockX, blockY, blockZ, smem, params);
-    held = held << 1 | (dispatch ? 1 : 0);
-    errs() << "Assumption likelihood: (" << held << ") " << willHold() << "\n";
+    // Only the last three outcomes feed the prediction
+    held = (held << 1 | (dispatch ? 1 : 0)) & 0x07;
 }
 
 Assumption::Prediction Assumption::willHold() const {
@@ -30,7 +39,7 @@ Assumption::Prediction Assumption::willHold() const {
 bool Assumption::holds(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params) const {
     return true;
 }
-bool Assumption::apply(llvm::Module* M) const {
+bool Assumption::apply(llvm::Function* K) const {
     return true;
 }
 bool Assumption::operator==(const Assumption& other) const {
@@ -39,9 +48,57 @@ bool Assumption::operator==(const Assumption& other) const {
 bool Assumption::equals(const Assumption& other) const {
     return false;
 }
+std::string Assumption::describe() const {
+    return "true";
+}
+AssumptionKey Assumption::key() const {
+    return AssumptionKey{(uint8_t)kind, 0, 0, 0, 0};
+}
+
+std::shared_ptr<Assumption> Assumption::fromKey(const AssumptionKey& k) {
+    switch(k.kind) {
+      case AK_Geometry:
+        return std::make_shared<GeometryAssumption>((GeometryAssumption::Dim)k.dim, k.value);
+      case AK_GeometryRange:
+        return std::make_shared<GeometryRangeAssumption>((GeometryAssumption::Dim)k.dim, k.value, k.value2);
+      case AK_GeometryMultiple:
+        return std::make_shared<GeometryMultipleAssumption>((GeometryAssumption::Dim)k.dim, k.value);
+      case AK_GridCoverage:
+        return std::make_shared<GridCoverageAssumption>(k.dim, k.value, k.aux, (GridCoverageAssumption::Relation)k.value2);
+      case AK_Param:
+        return std::make_shared<ParamAssumption>(k.aux, k.value);
+      case AK_Coarsen:
+        return std::make_shared<CoarsenAssumption>(k.value);
+    }
+    return nullptr;
+}
+
+uint64_t AssumptionKey::hash() const {
+    uint64_t h = (uint64_t)kind << 56 ^ (uint64_t)dim << 48 ^ (uint64_t)aux << 32 ^ (uint32_t)value;
+    h ^= (uint64_t)(uint32_t)value2 * 0x9E3779B97F4A7C15ULL;
+    // splitmix64 finalizer
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+uint64_t hashAssumptions(const AssumptionList& assumptions) {
+    // FNV-1a, so the key is the same from run to run
+    uint64_t h = 14695981039346656037ULL;
+    for(auto a=assumptions.begin(),e=assumptions.end(); a!=e; ++a) {
+      std::string d = (*a)->describe();
+      for(auto c=d.begin(),ce=d.end(); c!=ce; ++c) {
+        h ^= (unsigned char)*c;
+        h *= 1099511628211ULL;
+      }
+      h ^= ';';
+      h *= 1099511628211ULL;
+    }
+    return h;
+}
 
 /***************************************
- * GeometryAssumption
+ * NVVM special register helpers
  **************************************/
 
 std::string GeometryAssumption::intrinsic_names[] = {
@@ -53,38 +110,494 @@ std::string GeometryAssumption::intrinsic_names[] = {
   "llvm.nvvm.read.ptx.sreg.ntid.z"
 };
 
-bool GeometryAssumption::holds(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params) const {
-    return (dim == Dim::GridX && value == gridX) ||
-           (dim == Dim::GridY && value == gridY) ||
-           (dim == Dim::GridZ && value == gridZ) ||
-           (dim == Dim::BlockX && value == blockX) ||
-           (dim == Dim::BlockY && value == blockY) ||
-           (dim == Dim::BlockZ && value == blockZ);
-}
-bool GeometryAssumption::apply(llvm::Module* M) const {
-    using namespace llvm;
-    for(auto F=M->begin(),e=M->end(); F!=e; ++F) {
-      for(auto B=F->begin(),e=F->end(); B!=e; ++B) {
-        bool changed = true;
-        while(changed) {
-          changed = false;
-          for(auto I=B->begin(),e=B->end(); I!=e; ++I) {
-            // If this is the appropriate intrinsic,
-            if(auto call=dyn_cast<CallInst>(I)) {
-              errs() << call->getCalledFunction()->getName() << "\n";
-            }
-            // replace it with a constant of our value
-          }
-        }
+std::string GeometryAssumption::dim_names[] = {
+  "gridX", "gridY", "gridZ", "blockX", "blockY", "blockZ"
+};
+
+static std::string ctaid_names[] = {
+  "llvm.nvvm.read.ptx.sreg.ctaid.x",
+  "llvm.nvvm.read.ptx.sreg.ctaid.y",
+  "llvm.nvvm.read.ptx.sreg.ctaid.z"
+};
+
+static std::string tid_names[] = {
+  "llvm.nvvm.read.ptx.sreg.tid.x",
+  "llvm.nvvm.read.ptx.sreg.tid.y",
+  "llvm.nvvm.read.ptx.sreg.tid.z"
+};
+
+/*
+ * Collect every call to the named intrinsic in M
+ */
+static void findIntrinsicCalls(Module* M, StringRef name, SmallVectorImpl<CallInst*>& calls) {
+    Function* F = M->getFunction(name);
+    if(!F)
+      return;
+    for(auto U=F->user_begin(),e=F->user_end(); U!=e; ++U) {
+      if(auto call=dyn_cast<CallInst>(*U)) {
+        if(call->getCalledFunction() == F)
+          calls.push_back(call);
+      }
+    }
+}
+
+static bool isCallTo(Value* V, StringRef name) {
+    if(auto call=dyn_cast<CallInst>(V)) {
+      Function* F = call->getCalledFunction();
+      return F && F->getName() == name;
+    }
+    return false;
+}
+
+/*
+ * Narrow the !range metadata on an intrinsic call to [lo, hi). Existing
+ * ranges may wrap (NVVM tags nctaid with [1, 0x80000000)), so intersect as
+ * ConstantRanges rather than comparing signed bounds.
+ */
+static bool narrowRange(CallInst* call, int64_t lo, int64_t hi) {
+    unsigned bits = call->getType()->getIntegerBitWidth();
+    ConstantRange range(APInt(bits, lo), APInt(bits, hi));
+    if(auto md = call->getMetadata(LLVMContext::MD_range)) {
+      if(md->getNumOperands() == 2) {
+        ConstantRange old(mdconst::extract<ConstantInt>(md->getOperand(0))->getValue(),
+                          mdconst::extract<ConstantInt>(md->getOperand(1))->getValue());
+        range = range.intersectWith(old);
       }
     }
+    // !range can't express an empty or full set
+    if(range.isEmptySet() || range.isFullSet())
+      return false;
+    MDBuilder MDB(call->getContext());
+    call->setMetadata(LLVMContext::MD_range, MDB.createRange(range.getLower(), range.getUpper()));
     return true;
 }
 
+static bool replaceWithConstant(Module* M, StringRef name, int value) {
+    SmallVector<CallInst*, 8> calls;
+    findIntrinsicCalls(M, name, calls);
+    for(auto c=calls.begin(),e=calls.end(); c!=e; ++c) {
+      (*c)->replaceAllUsesWith(ConstantInt::get((*c)->getType(), value));
+      (*c)->eraseFromParent();
+    }
+    return !calls.empty();
+}
+
+/***************************************
+ * GeometryAssumption
+ **************************************/
+
+int GeometryAssumption::select(Dim dim, int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ) {
+    switch(dim) {
+      case Dim::GridX: return gridX;
+      case Dim::GridY: return gridY;
+      case Dim::GridZ: return gridZ;
+      case Dim::BlockX: return blockX;
+      case Dim::BlockY: return blockY;
+      case Dim::BlockZ: return blockZ;
+    }
+    return 0;
+}
+
+bool GeometryAssumption::holds(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params) const {
+    return value == select(dim, gridX, gridY, gridZ, blockX, blockY, blockZ);
+}
+bool GeometryAssumption::apply(llvm::Function* K) const {
+    // Every read of this dimension becomes a constant of our value
+    return replaceWithConstant(K->getParent(), intrinsic_names[dim], value);
+}
+
 bool GeometryAssumption::equals(const Assumption& a) const {
     if(auto ga = dyn_cast<GeometryAssumption>(&a)) {
         return ga->dim == dim && ga->value == value;
     }
     return false;
 }
+std::string GeometryAssumption::describe() const {
+    return dim_names[dim] + "==" + std::to_string(value);
+}
+AssumptionKey GeometryAssumption::key() const {
+    return keyFor(dim, value);
+}
+
+/***************************************
+ * GeometryRangeAssumption
+ **************************************/
+
+AssumptionKey GeometryRangeAssumption::bucketFor(GeometryAssumption::Dim dim, int value) {
+    int lo = 1;
+    while(lo <= value / 2)
+      lo <<= 1;
+    int hi = lo > INT32_MAX / 2 ? INT32_MAX : lo * 2 - 1;
+    return keyFor(dim, lo, hi);
+}
+
+bool GeometryRangeAssumption::holds(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params) const {
+    int v = GeometryAssumption::select(dim, gridX, gridY, gridZ, blockX, blockY, blockZ);
+    return v >= lo && v <= hi;
+}
+bool GeometryRangeAssumption::apply(llvm::Function* K) const {
+    Module* M = K->getParent();
+    bool changed = false;
+    SmallVector<CallInst*, 8> calls;
+    findIntrinsicCalls(M, GeometryAssumption::intrinsicName(dim), calls);
+    for(auto c=calls.begin(),e=calls.end(); c!=e; ++c)
+      changed |= narrowRange(*c, lo, (int64_t)hi + 1);
+
+    // The matching index (ctaid for grids, tid for blocks) is below hi
+    calls.clear();
+    if(dim <= GeometryAssumption::GridZ)
+      findIntrinsicCalls(M, ctaid_names[dim], calls);
+    else
+      findIntrinsicCalls(M, tid_names[dim - GeometryAssumption::BlockX], calls);
+    for(auto c=calls.begin(),e=calls.end(); c!=e; ++c)
+      changed |= narrowRange(*c, 0, hi);
+    return changed;
+}
+
+bool GeometryRangeAssumption::equals(const Assumption& a) const {
+    if(auto ra = dyn_cast<GeometryRangeAssumption>(&a)) {
+        return ra->dim == dim && ra->lo == lo && ra->hi == hi;
+    }
+    return false;
+}
+std::string GeometryRangeAssumption::describe() const {
+    return GeometryAssumption::dimName(dim) + " in [" + std::to_string(lo) + "," + std::to_string(hi) + "]";
+}
+AssumptionKey GeometryRangeAssumption::key() const {
+    return keyFor(dim, lo, hi);
+}
+
+/***************************************
+ * GeometryMultipleAssumption
+ **************************************/
+
+bool GeometryMultipleAssumption::holds(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params) const {
+    return GeometryAssumption::select(dim, gridX, gridY, gridZ, blockX, blockY, blockZ) % factor == 0;
+}
+bool GeometryMultipleAssumption::apply(llvm::Function* K) const {
+    Module* M = K->getParent();
+    SmallVector<CallInst*, 8> calls;
+    findIntrinsicCalls(M, GeometryAssumption::intrinsicName(dim), calls);
+    if(calls.empty())
+      return false;
+    Function* assume = Intrinsic::getDeclaration(M, Intrinsic::assume);
+    for(auto c=calls.begin(),e=calls.end(); c!=e; ++c) {
+      // assume((v & (factor-1)) == 0) is what known-bits understands for
+      // powers of two; anything else gets a plain remainder
+      IRBuilder<> B((*c)->getNextNode());
+      Value* rem;
+      if((factor & (factor - 1)) == 0)
+        rem = B.CreateAnd(*c, factor - 1);
+      else
+        rem = B.CreateURem(*c, ConstantInt::get((*c)->getType(), factor));
+      B.CreateCall(assume, B.CreateICmpEQ(rem, ConstantInt::get((*c)->getType(), 0)));
+    }
+    return true;
+}
+
+bool GeometryMultipleAssumption::equals(const Assumption& a) const {
+    if(auto ma = dyn_cast<GeometryMultipleAssumption>(&a)) {
+        return ma->dim == dim && ma->factor == factor;
+    }
+    return false;
+}
+std::string GeometryMultipleAssumption::describe() const {
+    return GeometryAssumption::dimName(dim) + "%" + std::to_string(factor) + "==0";
+}
+AssumptionKey GeometryMultipleAssumption::key() const {
+    return keyFor(dim, factor);
+}
 
+/***************************************
+ * GridCoverageAssumption
+ **************************************/
+
+bool GridCoverageAssumption::holds(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params) const {
+    int grid[] = {gridX, gridY, gridZ};
+    int block[] = {blockX, blockY, blockZ};
+    if(block[dim] != blockSize)
+      return false;
+    long long threads = (long long)grid[dim] * blockSize;
+    long long n = *(int*)params[param];
+    return rel == Covers ? threads >= n : threads <= n;
+}
+
+/*
+ * V without any sext/zext wrapped around it. Geometry values and the
+ * indices built from them are non-negative and fit in 32 bits, so the
+ * extensions don't change them.
+ */
+static Value* stripExtensions(Value* V) {
+    while(isa<SExtInst>(V) || isa<ZExtInst>(V))
+      V = cast<CastInst>(V)->getOperand(0);
+    return V;
+}
+
+/*
+ * Matches blockIdx*blockSize + threadIdx along dim, as written by hand
+ * (mul by a constant, or by blockDim once pinned, in either order) or after
+ * strength reduction (shl), computed in 32 or 64 bits.
+ */
+static bool isGlobalThreadIndex(Value* V, int dim, int blockSize) {
+    auto bin = dyn_cast<BinaryOperator>(stripExtensions(V));
+    if(!bin || (bin->getOpcode() != Instruction::Add && bin->getOpcode() != Instruction::Or))
+      return false;
+    for(unsigned i=0; i<2; ++i) {
+      if(!isCallTo(stripExtensions(bin->getOperand(1-i)), tid_names[dim]))
+        continue;
+      auto scaled = dyn_cast<BinaryOperator>(stripExtensions(bin->getOperand(i)));
+      if(!scaled)
+        continue;
+      for(unsigned j=0; j<2; ++j) {
+        if(!isCallTo(stripExtensions(scaled->getOperand(j)), ctaid_names[dim]))
+          continue;
+        auto c = dyn_cast<ConstantInt>(scaled->getOperand(1-j));
+        if(!c)
+          continue;
+        if(scaled->getOpcode() == Instruction::Mul && c->getSExtValue() == blockSize)
+          return true;
+        // Only the shift amount can be the constant
+        if(scaled->getOpcode() == Instruction::Shl && j == 0 && c->getZExtValue() < 31 &&
+           (1 << c->getZExtValue()) == blockSize)
+          return true;
+      }
+    }
+    return false;
+}
+
+bool GridCoverageAssumption::apply(llvm::Function* K) const {
+    // Pin the block size first, so (blockIdx*blockDim) becomes a constant multiply
+    bool changed = replaceWithConstant(K->getParent(), GeometryAssumption::intrinsicName((GeometryAssumption::Dim)(GeometryAssumption::BlockX + dim)), blockSize);
+    if(rel != Within || param >= K->arg_size())
+      return changed;
+
+    // Every global thread index is below gridDim*blockSize <= n
+    Value* n = &*(K->arg_begin() + param);
+    SmallVector<ICmpInst*, 4> folded;
+    SmallVector<bool, 4> results;
+    for(auto B=K->begin(),e=K->end(); B!=e; ++B) {
+      for(auto I=B->begin(),e=B->end(); I!=e; ++I) {
+        auto cmp = dyn_cast<ICmpInst>(&*I);
+        if(!cmp)
+          continue;
+        // n may be widened to compare against a 64-bit index
+        ICmpInst::Predicate pred = cmp->getPredicate();
+        bool nFirst = stripExtensions(cmp->getOperand(0)) == n;
+        if(nFirst)
+          pred = cmp->getSwappedPredicate();
+        else if(stripExtensions(cmp->getOperand(1)) != n)
+          continue;
+        Value* idx = nFirst ? cmp->getOperand(1) : cmp->getOperand(0);
+        if(!isGlobalThreadIndex(idx, dim, blockSize))
+          continue;
+        // pred now reads (idx pred n)
+        if(pred == ICmpInst::ICMP_SLT || pred == ICmpInst::ICMP_ULT ||
+           pred == ICmpInst::ICMP_SLE || pred == ICmpInst::ICMP_ULE || pred == ICmpInst::ICMP_NE) {
+          folded.push_back(cmp);
+          results.push_back(true);
+        } else if(pred == ICmpInst::ICMP_SGE || pred == ICmpInst::ICMP_UGE ||
+                  pred == ICmpInst::ICMP_SGT || pred == ICmpInst::ICMP_UGT || pred == ICmpInst::ICMP_EQ) {
+          folded.push_back(cmp);
+          results.push_back(false);
+        }
+      }
+    }
+    for(unsigned i=0; i<folded.size(); ++i) {
+      folded[i]->replaceAllUsesWith(ConstantInt::get(folded[i]->getType(), results[i]));
+      folded[i]->eraseFromParent();
+    }
+    return changed || !folded.empty();
+}
+
+bool GridCoverageAssumption::equals(const Assumption& a) const {
+    if(auto ca = dyn_cast<GridCoverageAssumption>(&a)) {
+        return ca->dim == dim && ca->blockSize == blockSize && ca->param == param && ca->rel == rel;
+    }
+    return false;
+}
+std::string GridCoverageAssumption::describe() const {
+    const std::string& g = GeometryAssumption::dimName((GeometryAssumption::Dim)(GeometryAssumption::GridX + dim));
+    const std::string& b = GeometryAssumption::dimName((GeometryAssumption::Dim)(GeometryAssumption::BlockX + dim));
+    return b + "==" + std::to_string(blockSize) + " && " + g + "*" + b +
+           (rel == Covers ? ">=" : "<=") + "param" + std::to_string(param);
+}
+AssumptionKey GridCoverageAssumption::key() const {
+    return keyFor(dim, blockSize, param, rel);
+}
+
+/***************************************
+ * ParamAssumption
+ **************************************/
+
+bool ParamAssumption::holds(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params) const {
+    return *(int*)params[param] == value;
+}
+bool ParamAssumption::apply(llvm::Function* K) const {
+    if(param >= K->arg_size())
+      return false;
+    Argument* arg = &*(K->arg_begin() + param);
+    if(!arg->getType()->isIntegerTy(32) || arg->use_empty())
+      return false;
+    arg->replaceAllUsesWith(ConstantInt::get(arg->getType(), value));
+    return true;
+}
+
+bool ParamAssumption::equals(const Assumption& a) const {
+    if(auto pa = dyn_cast<ParamAssumption>(&a)) {
+        return pa->param == param && pa->value == value;
+    }
+    return false;
+}
+std::string ParamAssumption::describe() const {
+    return "param" + std::to_string(param) + "==" + std::to_string(value);
+}
+AssumptionKey ParamAssumption::key() const {
+    return keyFor(param, value);
+}
+
+/***************************************
+ * CoarsenAssumption
+ **************************************/
+
+bool CoarsenAssumption::holds(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params) const {
+    return gridX % factor == 0;
+}
+
+static bool isGeometryRead(StringRef name) {
+    for(int d=0; d<3; ++d) {
+      if(name == ctaid_names[d] || name == tid_names[d] ||
+         name == GeometryAssumption::intrinsicName((GeometryAssumption::Dim)(GeometryAssumption::GridX + d)) ||
+         name == GeometryAssumption::intrinsicName((GeometryAssumption::Dim)(GeometryAssumption::BlockX + d)))
+        return true;
+    }
+    return false;
+}
+
+bool CoarsenAssumption::canCoarsen(const llvm::Function* K) {
+    if(!K || K->isDeclaration() || !K->getReturnType()->isVoidTy())
+      return false;
+    const DataLayout& DL = K->getParent()->getDataLayout();
+    for(auto B=K->begin(),e=K->end(); B!=e; ++B) {
+      for(auto I=B->begin(),e=B->end(); I!=e; ++I) {
+        // Anything another thread could be waiting on or racing with
+        if(isa<AtomicRMWInst>(&*I) || isa<AtomicCmpXchgInst>(&*I) || isa<FenceInst>(&*I) || isa<InvokeInst>(&*I))
+          return false;
+        if(auto load = dyn_cast<LoadInst>(&*I)) {
+          if(load->isVolatile() || !load->isUnordered())
+            return false;
+        }
+        if(auto store = dyn_cast<StoreInst>(&*I)) {
+          if(store->isVolatile() || !store->isUnordered())
+            return false;
+        }
+        // Barriers and every other call; only geometry reads and hints are safe
+        if(auto call = dyn_cast<CallInst>(&*I)) {
+          const Function* F = call->getCalledFunction();
+          if(!F)
+            return false;
+          Intrinsic::ID id = F->getIntrinsicID();
+          if(id != Intrinsic::assume && id != Intrinsic::dbg_value && id != Intrinsic::dbg_declare &&
+             id != Intrinsic::lifetime_start && id != Intrinsic::lifetime_end && !isGeometryRead(F->getName()))
+            return false;
+        }
+        // Shared memory is visible to the rest of the block
+        for(auto op=I->op_begin(),oe=I->op_end(); op!=oe; ++op) {
+          auto ptr = dyn_cast<PointerType>((*op)->getType());
+          if(!ptr)
+            continue;
+          if(ptr->getAddressSpace() == 3)
+            return false;
+          auto base = dyn_cast<GlobalVariable>(GetUnderlyingObject(*op, DL));
+          if(base && base->getType()->getAddressSpace() == 3)
+            return false;
+        }
+      }
+    }
+    return true;
+}
+
+/*
+ * Replace every call to the named intrinsic inside F with v
+ */
+static void replaceCallsIn(Function* F, StringRef name, Value* v) {
+    SmallVector<CallInst*, 8> calls;
+    findIntrinsicCalls(F->getParent(), name, calls);
+    for(auto c=calls.begin(),e=calls.end(); c!=e; ++c) {
+      if((*c)->getFunction() != F)
+        continue;
+      (*c)->replaceAllUsesWith(v);
+      (*c)->eraseFromParent();
+    }
+}
+
+bool CoarsenAssumption::apply(llvm::Function* K) const {
+    if(factor < 2)
+      return false;
+    if(!canCoarsen(K)) {
+      errs() << K->getName() << ": Kernel is not safe to coarsen, leaving it unchanged.\n";
+      return false;
+    }
+    Module* M = K->getParent();
+    LLVMContext& C = M->getContext();
+    Type* i32 = Type::getInt32Ty(C);
+
+    // Move the body into an internal function taking the logical
+    // blockIdx.x and gridDim.x as two extra arguments
+    FunctionType* KT = K->getFunctionType();
+    std::vector<Type*> argTypes(KT->param_begin(), KT->param_end());
+    argTypes.push_back(i32);
+    argTypes.push_back(i32);
+    Function* body = Function::Create(FunctionType::get(KT->getReturnType(), argTypes, false),
+                                      GlobalValue::InternalLinkage, K->getName() + ".coarsened", M);
+    body->setAttributes(K->getAttributes());
+    body->getBasicBlockList().splice(body->begin(), K->getBasicBlockList());
+    auto BA = body->arg_begin();
+    for(auto A=K->arg_begin(),e=K->arg_end(); A!=e; ++A, ++BA) {
+      A->replaceAllUsesWith(&*BA);
+      BA->takeName(&*A);
+    }
+    Argument* vctaid = &*BA++;
+    Argument* vnctaid = &*BA;
+    vctaid->setName("vctaid.x");
+    vnctaid->setName("vnctaid.x");
+    replaceCallsIn(body, ctaid_names[0], vctaid);
+    replaceCallsIn(body, GeometryAssumption::intrinsicName(GeometryAssumption::GridX), vnctaid);
+
+    // Block b of the smaller grid runs logical blocks b, b+gridX, ..., so
+    // neighbouring threads still touch neighbouring elements
+    BasicBlock* entry = BasicBlock::Create(C, "entry", K);
+    IRBuilder<> B(entry);
+    Value* ctaid = B.CreateCall(Intrinsic::getDeclaration(M, Intrinsic::nvvm_read_ptx_sreg_ctaid_x));
+    Value* nctaid = B.CreateCall(Intrinsic::getDeclaration(M, Intrinsic::nvvm_read_ptx_sreg_nctaid_x));
+    Value* vn = B.CreateMul(nctaid, ConstantInt::get(i32, factor));
+    SmallVector<CallInst*, 8> calls;
+    for(int i=0; i<factor; ++i) {
+      std::vector<Value*> args;
+      for(auto A=K->arg_begin(),e=K->arg_end(); A!=e; ++A)
+        args.push_back(&*A);
+      args.push_back(i ? B.CreateAdd(ctaid, B.CreateMul(nctaid, ConstantInt::get(i32, i))) : ctaid);
+      args.push_back(vn);
+      calls.push_back(B.CreateCall(body, args));
+    }
+    B.CreateRetVoid();
+
+    for(auto c=calls.begin(),e=calls.end(); c!=e; ++c) {
+      InlineFunctionInfo IFI;
+      InlineFunction(*c, IFI);
+    }
+    body->eraseFromParent();
+    return true;
+}
+
+bool CoarsenAssumption::equals(const Assumption& a) const {
+    if(auto ca = dyn_cast<CoarsenAssumption>(&a)) {
+        return ca->factor == factor;
+    }
+    return false;
+}
+std::string CoarsenAssumption::describe() const {
+    return "coarsen gridX/" + std::to_string(factor);
+}
+AssumptionKey CoarsenAssumption::key() const {
+    return keyFor(factor);
+}
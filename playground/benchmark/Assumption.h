@@ -1,12 +1,40 @@
+#ifndef _ASSUMPTION_H_
+#define _ASSUMPTION_H_
+
 #include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
 
 #include <cuda.h>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+/*
+ * Compact identity of an assumption: its kind, the launch dimension or
+ * parameter it constrains, and up to three values. Two assumptions are
+ * equal exactly when their keys are.
+ */
+struct AssumptionKey {
+  uint8_t kind;
+  uint8_t dim;
+  uint16_t aux;
+  int32_t value;
+  int32_t value2;
+  bool operator==(const AssumptionKey& o) const {
+    return kind == o.kind && dim == o.dim && aux == o.aux && value == o.value && value2 == o.value2;
+  }
+  uint64_t hash() const;
+};
+
+class Assumption;
+typedef std::vector<std::shared_ptr<Assumption>> AssumptionList;
+
 /*
  * Models an assumption made when JIT-compiling a KernelFunction
  */
 class Assumption {
   public:
-    enum AsmpKind {AK_Geometry};
+    enum AsmpKind {AK_Geometry, AK_GeometryRange, AK_GeometryMultiple, AK_GridCoverage, AK_Param, AK_Coarsen};
   private:
     int held=0;
     AsmpKind kind;
@@ -14,32 +42,40 @@ class Assumption {
   enum Prediction {Never, Unlikely, Unknown, Likely, VeryLikely, Always};
   Assumption(AsmpKind ak) : kind(ak) {}
   Prediction willHold() const;
+  /*
+   * False when the assumption missed on each of the last three launches
+   */
+  bool recentlyHeld() const {return held != 0;}
   /*
    * Given a particular Kernel invocation, returns whether or not the assumption holds for this invocation
    */
   void update_assumption(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params);
   /*
-   * Apply knowledge gained from this assumption to an LLVM module
+   * Apply knowledge gained from this assumption to kernel K and its module
    */
-  virtual bool apply(llvm::Module* M) const;
+  virtual bool apply(llvm::Function* K) const;
   /*
    * Virtual method implementing equality
    */
   virtual bool equals(const Assumption& other) const;
   bool operator==(const Assumption& other) const;
   const AsmpKind& getKind() const {return kind;}
+  virtual AssumptionKey key() const;
+  /*
+   * Rebuild the assumption identified by key
+   */
+  static std::shared_ptr<Assumption> fromKey(const AssumptionKey& key);
+  /*
+   * Human-readable form, used for logs and compile artifact keys
+   */
+  virtual std::string describe() const;
   virtual bool holds(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params) const;
 };
 
-typedef std::vector<std::shared_ptr<Assumption>> AssumptionList;
-
-struct cmpBySize {
-  bool operator()(const AssumptionList& a, const AssumptionList& b) const {
-    return a.size() > b.size();
-  }
-};
-
-typedef std::map<AssumptionList,CUmodule,cmpBySize> CUModuleMap;
+/*
+ * Stable 64-bit hash of an assumption set, built from each describe()
+ */
+uint64_t hashAssumptions(const AssumptionList& assumptions);
 
 class GeometryAssumption : public Assumption {
   public:
@@ -49,13 +85,167 @@ class GeometryAssumption : public Assumption {
     int value;
   public:
     GeometryAssumption(Dim dim, int value) : Assumption(AK_Geometry), dim(dim), value(value) {}
+    static AssumptionKey keyFor(Dim dim, int value) {
+      return AssumptionKey{AK_Geometry, (uint8_t)dim, 0, value, 0};
+    }
     bool holds(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params) const;
-    bool apply(llvm::Module* M) const;
+    bool apply(llvm::Function* K) const;
     bool equals(const Assumption& other) const;
+    std::string describe() const;
+    AssumptionKey key() const;
+    /*
+     * Select the launch dimension dim from a kernel invocation
+     */
+    static int select(Dim dim, int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ);
+    static const std::string& intrinsicName(Dim dim) {return intrinsic_names[dim];}
+    static const std::string& dimName(Dim dim) {return dim_names[dim];}
   private:
     static std::string intrinsic_names[6];
+    static std::string dim_names[6];
   public:
     static bool classof(const Assumption* a) {
       return a->getKind() == AK_Geometry;
     }
 };
+
+/*
+ * Assumes a launch dimension falls within [lo, hi], so that one variant
+ * can serve every input whose geometry lands in the same bucket
+ */
+class GeometryRangeAssumption : public Assumption {
+  private:
+    GeometryAssumption::Dim dim;
+    int lo;
+    int hi;
+  public:
+    GeometryRangeAssumption(GeometryAssumption::Dim dim, int lo, int hi) : Assumption(AK_GeometryRange), dim(dim), lo(lo), hi(hi) {}
+    static AssumptionKey keyFor(GeometryAssumption::Dim dim, int lo, int hi) {
+      return AssumptionKey{AK_GeometryRange, (uint8_t)dim, 0, lo, hi};
+    }
+    /*
+     * The power-of-two bucket [2^k, 2^(k+1)-1] containing value
+     */
+    static AssumptionKey bucketFor(GeometryAssumption::Dim dim, int value);
+    bool holds(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params) const;
+    bool apply(llvm::Function* K) const;
+    bool equals(const Assumption& other) const;
+    std::string describe() const;
+    AssumptionKey key() const;
+    static bool classof(const Assumption* a) {
+      return a->getKind() == AK_GeometryRange;
+    }
+};
+
+/*
+ * Assumes a launch dimension is a multiple of factor
+ */
+class GeometryMultipleAssumption : public Assumption {
+  private:
+    GeometryAssumption::Dim dim;
+    int factor;
+  public:
+    GeometryMultipleAssumption(GeometryAssumption::Dim dim, int factor) : Assumption(AK_GeometryMultiple), dim(dim), factor(factor) {}
+    static AssumptionKey keyFor(GeometryAssumption::Dim dim, int factor) {
+      return AssumptionKey{AK_GeometryMultiple, (uint8_t)dim, 0, factor, 0};
+    }
+    bool holds(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params) const;
+    bool apply(llvm::Function* K) const;
+    bool equals(const Assumption& other) const;
+    std::string describe() const;
+    AssumptionKey key() const;
+    static bool classof(const Assumption* a) {
+      return a->getKind() == AK_GeometryMultiple;
+    }
+};
+
+/*
+ * Relates the number of threads launched along one dimension to an integer
+ * kernel parameter n, with the block size along that dimension fixed:
+ *   Covers: blockDim == blockSize && gridDim*blockSize >= n
+ *   Within: blockDim == blockSize && gridDim*blockSize <= n
+ * Within lets bounds guards like (blockIdx*blockSize + threadIdx < n) fold
+ * away; holding both means the launch has no partial blocks.
+ */
+class GridCoverageAssumption : public Assumption {
+  public:
+    enum Relation {Covers, Within};
+  private:
+    int dim;
+    int blockSize;
+    unsigned param;
+    Relation rel;
+  public:
+    /*
+     * dim selects x, y or z (0, 1, 2)
+     */
+    GridCoverageAssumption(int dim, int blockSize, unsigned param, Relation rel) : Assumption(AK_GridCoverage), dim(dim), blockSize(blockSize), param(param), rel(rel) {}
+    static AssumptionKey keyFor(int dim, int blockSize, unsigned param, Relation rel) {
+      return AssumptionKey{AK_GridCoverage, (uint8_t)dim, (uint16_t)param, blockSize, rel};
+    }
+    bool holds(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params) const;
+    bool apply(llvm::Function* K) const;
+    bool equals(const Assumption& other) const;
+    std::string describe() const;
+    AssumptionKey key() const;
+    static bool classof(const Assumption* a) {
+      return a->getKind() == AK_GridCoverage;
+    }
+};
+
+/*
+ * Assumes a 32-bit integer kernel parameter has a fixed value
+ */
+class ParamAssumption : public Assumption {
+  private:
+    unsigned param;
+    int value;
+  public:
+    ParamAssumption(unsigned param, int value) : Assumption(AK_Param), param(param), value(value) {}
+    static AssumptionKey keyFor(unsigned param, int value) {
+      return AssumptionKey{AK_Param, 0, (uint16_t)param, value, 0};
+    }
+    bool holds(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params) const;
+    bool apply(llvm::Function* K) const;
+    bool equals(const Assumption& other) const;
+    std::string describe() const;
+    AssumptionKey key() const;
+    static bool classof(const Assumption* a) {
+      return a->getKind() == AK_Param;
+    }
+};
+
+/*
+ * Assumes gridX is a multiple of factor, and coarsens the kernel so each
+ * thread does the work of factor threads from blocks gridX/factor apart.
+ * A variant carrying this assumption is launched with gridX/factor blocks.
+ *
+ * Only kernels passing canCoarsen() are transformed. The rewrite replaces
+ * the kernel's reads of blockIdx.x and gridDim.x, so it must be applied
+ * after every other assumption.
+ */
+class CoarsenAssumption : public Assumption {
+  private:
+    int factor;
+  public:
+    CoarsenAssumption(int factor) : Assumption(AK_Coarsen), factor(factor) {}
+    static AssumptionKey keyFor(int factor) {
+      return AssumptionKey{AK_Coarsen, 0, 0, factor, 0};
+    }
+    /*
+     * Whether running several threads' work in sequence on one thread is
+     * safe for K: no barriers, calls, atomics, volatile accesses or shared
+     * memory, and no special registers besides thread and block geometry
+     */
+    static bool canCoarsen(const llvm::Function* K);
+    int getFactor() const {return factor;}
+    bool holds(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params) const;
+    bool apply(llvm::Function* K) const;
+    bool equals(const Assumption& other) const;
+    std::string describe() const;
+    AssumptionKey key() const;
+    static bool classof(const Assumption* a) {
+      return a->getKind() == AK_Coarsen;
+    }
+};
+
+#endif
@@ -0,0 +1,114 @@
+#include "llvm/Support/raw_ostream.h"
+#include "AssumptionTable.h"
+
+using namespace llvm;
+
+AssumptionTable::AssumptionTable() {
+    for(unsigned i=0; i<Slots; ++i)
+      slots[i] = -1;
+}
+
+int AssumptionTable::find(const AssumptionKey& key) const {
+    for(unsigned s=key.hash() & (Slots - 1);; s=(s + 1) & (Slots - 1)) {
+      int i = slots[s];
+      if(i < 0 || keys[i] == key)
+        return i;
+    }
+}
+
+int AssumptionTable::intern(const AssumptionKey& key) {
+    unsigned s = key.hash() & (Slots - 1);
+    for(; slots[s] >= 0; s=(s + 1) & (Slots - 1)) {
+      if(keys[slots[s]] == key)
+        return slots[s];
+    }
+    int i = count;
+    if(count == Capacity) {
+      i = reclaim();
+      if(i < 0) {
+        if(!warnedFull)
+          errs() << "AssumptionTable: full, ignoring new assumptions.\n";
+        warnedFull = true;
+        return -1;
+      }
+      unlink(i);
+      // Unlinking may have shifted a key into the hole we found
+      s = key.hash() & (Slots - 1);
+      while(slots[s] >= 0)
+        s = (s + 1) & (Slots - 1);
+    } else {
+      count++;
+    }
+    // Slots is twice Capacity, so the probe always finds a hole
+    keys[i] = key;
+    entries[i] = Assumption::fromKey(key);
+    fresh.set(i);
+    slots[s] = i;
+    return i;
+}
+
+int AssumptionTable::reclaim() {
+    // Start after the last victim, so recycling spreads over the table
+    for(unsigned n=0; n<Capacity; ++n) {
+      unsigned i = (reclaimCursor + n) % Capacity;
+      if(refs[i] || pinned.test(i) || fresh.test(i) || entries[i]->recentlyHeld())
+        continue;
+      reclaimCursor = i + 1;
+      return i;
+    }
+    return -1;
+}
+
+void AssumptionTable::retain(const Mask& mask) {
+    for(unsigned i=0; i<Capacity; ++i) {
+      if(mask.test(i))
+        refs[i]++;
+    }
+}
+
+void AssumptionTable::release(const Mask& mask) {
+    for(unsigned i=0; i<Capacity; ++i) {
+      if(mask.test(i) && refs[i])
+        refs[i]--;
+    }
+}
+
+void AssumptionTable::unlink(unsigned i) {
+    unsigned s = keys[i].hash() & (Slots - 1);
+    while(slots[s] != (int)i)
+      s = (s + 1) & (Slots - 1);
+    // Backward-shift deletion: pull later keys of the probe run into the
+    // hole unless that would move them before their home slot
+    for(unsigned j=(s + 1) & (Slots - 1); slots[j] >= 0; j=(j + 1) & (Slots - 1)) {
+      unsigned home = keys[slots[j]].hash() & (Slots - 1);
+      if(((j - home) & (Slots - 1)) >= ((j - s) & (Slots - 1))) {
+        slots[s] = slots[j];
+        s = j;
+      }
+    }
+    slots[s] = -1;
+}
+
+void AssumptionTable::update(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params) {
+    for(unsigned i=0; i<count; ++i)
+      entries[i]->update_assumption(gridX, gridY, gridZ, blockX, blockY, blockZ, smem, params);
+    fresh.reset();
+}
+
+AssumptionTable::Mask AssumptionTable::likely() const {
+    Mask m = pinned;
+    for(unsigned i=0; i<count; ++i) {
+      if(entries[i]->willHold() >= Assumption::Likely)
+        m.set(i);
+    }
+    return m;
+}
+
+AssumptionList AssumptionTable::select(const Mask& mask) const {
+    AssumptionList list;
+    for(unsigned i=0; i<count; ++i) {
+      if(mask.test(i))
+        list.push_back(entries[i]);
+    }
+    return list;
+}
@@ -0,0 +1,77 @@
+#ifndef _ASSUMPTIONTABLE_H_
+#define _ASSUMPTIONTABLE_H_
+
+#include <bitset>
+#include <memory>
+#include <stdint.h>
+
+#include "Assumption.h"
+
+/*
+ * Interned assumptions for one KernelFunction, indexed by AssumptionKey.
+ *
+ * Keys live in a flat, fixed-size open-addressed table, so lookups never
+ * allocate and a launch whose assumptions have all been seen before costs a
+ * few probes per key. An Assumption object is only created the first time
+ * its key is interned. Sets of assumptions are bitmasks over table indices.
+ *
+ * Once every index is in use, interning a new key recycles an entry that
+ * missed on each of its last three launches and that no variant, pending
+ * compile or hint refers to, so indices in retained masks keep their
+ * meaning.
+ */
+class AssumptionTable {
+  public:
+    static const unsigned Capacity = 128;
+    typedef std::bitset<Capacity> Mask;
+  private:
+    static const unsigned Slots = Capacity * 2;
+    int16_t slots[Slots];
+    AssumptionKey keys[Capacity];
+    std::shared_ptr<Assumption> entries[Capacity];
+    unsigned count = 0;
+    bool warnedFull = false;
+    Mask pinned;
+    // How many variants, compiles and requests refer to each entry; only
+    // entries nothing refers to are recycled
+    uint16_t refs[Capacity] = {};
+    // Interned since the last update, so without any history yet
+    Mask fresh;
+    unsigned reclaimCursor = 0;
+
+    int reclaim();
+    void unlink(unsigned i);
+
+  public:
+    AssumptionTable();
+    /*
+     * Index of key, adding it if new; -1 when full and nothing can be recycled
+     */
+    int intern(const AssumptionKey& key);
+    int find(const AssumptionKey& key) const;
+    bool isRetained(unsigned i) const {return refs[i] != 0;}
+    unsigned size() const {return count;}
+    Assumption& operator[](unsigned i) const {return *entries[i];}
+    /*
+     * Record whether each interned assumption held for this launch
+     */
+    void update(int gridX, int gridY, int gridZ, int blockX, int blockY, int blockZ, int smem, void** params);
+    /*
+     * Treat entry i as always holding, whatever its history says
+     */
+    void pin(unsigned i) {pinned.set(i);}
+    void clearPins() {pinned.reset();}
+    const Mask& getPinned() const {return pinned;}
+    /*
+     * Keep the entries in mask from being recycled until a matching release()
+     */
+    void retain(const Mask& mask);
+    void release(const Mask& mask);
+    /*
+     * Assumptions predicted at least Likely to hold, plus pinned ones
+     */
+    Mask likely() const;
+    AssumptionList select(const Mask& mask) const;
+};
+
+#endif
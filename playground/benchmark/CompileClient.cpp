@@ -0,0 +1,96 @@
+#include "llvm/Support/raw_ostream.h"
+#include "CompileClient.h"
+#include "CompileProtocol.h"
+
+#include <atomic>
+#include <chrono>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+// After failing to reach the server, compile in-process for a while
+static const int RetrySeconds = 30;
+// Give up on a server that stops answering, so a hung server can't stall a
+// launch; long enough for a large kernel's compile
+static const int TimeoutSeconds = 60;
+static std::atomic<long long> unavailableUntil(0);
+
+static long long now() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool CompileClient::enabled() {
+    static bool on = !CompileProtocol::socketPath().empty();
+    return on;
+}
+
+static int connectServer() {
+    std::string path = CompileProtocol::socketPath();
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(addr.sun_path))
+      return -1;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+      return -1;
+    // The send timeout also bounds connect() on a full backlog
+    timeval timeout = {TimeoutSeconds, 0};
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+       setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0 ||
+       connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+}
+
+std::string* CompileClient::compile(const std::string& bitcode, const std::string& bitcodeDigest,
+                                    const std::string& kernel, const std::string& arch,
+                                    const AssumptionList& assumptions, int* coarsened) {
+    if(now() < unavailableUntil)
+      return nullptr;
+    int fd = connectServer();
+    if(fd < 0) {
+      errs() << "CompileClient: server unavailable, compiling in-process.\n";
+      unavailableUntil = now() + RetrySeconds;
+      return nullptr;
+    }
+
+    CompileProtocol::Request req;
+    req.bitcodeDigest = bitcodeDigest;
+    req.kernel = kernel;
+    req.arch = arch;
+    for(auto a=assumptions.begin(),e=assumptions.end(); a!=e; ++a)
+      req.keys.push_back((*a)->key());
+
+    // Send the bitcode only if the server hasn't seen it yet
+    CompileProtocol::Status status = CompileProtocol::Failed;
+    std::string* ptx = new std::string;
+    int32_t factor = 1;
+    bool ok = CompileProtocol::writeRequest(fd, req) && CompileProtocol::readResponse(fd, status, *ptx, factor);
+    if(ok && status == CompileProtocol::NeedBitcode) {
+      req.bitcode = bitcode;
+      ok = CompileProtocol::writeRequest(fd, req) && CompileProtocol::readResponse(fd, status, *ptx, factor);
+    }
+    close(fd);
+
+    if(!ok || status != CompileProtocol::OK) {
+      errs() << "CompileClient: " << (ok ? "server failed to compile " : "lost connection compiling ")
+             << kernel << ", compiling in-process.\n";
+      // A server that timed out or hung up is likely to do so again
+      if(!ok)
+        unavailableUntil = now() + RetrySeconds;
+      delete ptx;
+      return nullptr;
+    }
+    if(coarsened)
+      *coarsened = factor;
+    return ptx;
+}
@@ -0,0 +1,26 @@
+#ifndef _COMPILECLIENT_H_
+#define _COMPILECLIENT_H_
+
+#include <stdint.h>
+#include <string>
+
+#include "Assumption.h"
+
+/*
+ * Client side of the node-local compile server (see compile_server.cpp).
+ * Enabled by setting GPUJIT_COMPILE_SOCKET; any failure to reach the server
+ * makes compile() return nullptr so the caller compiles in-process.
+ */
+class CompileClient {
+  public:
+    static bool enabled();
+    /*
+     * PTX for kernel in bitcode specialized by assumptions, or nullptr.
+     * *coarsened is set to the coarsening factor the server applied.
+     */
+    static std::string* compile(const std::string& bitcode, const std::string& bitcodeDigest,
+                                const std::string& kernel, const std::string& arch,
+                                const AssumptionList& assumptions, int* coarsened);
+};
+
+#endif
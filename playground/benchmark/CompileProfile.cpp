@@ -0,0 +1,121 @@
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include "CompileProfile.h"
+
+#include <mutex>
+#include <stdlib.h>
+
+using namespace llvm;
+
+static std::mutex summaryLock;
+
+static const char* profileRoot() {
+    static const char* root = getenv("GPUJIT_PROFILE_DIR");
+    return root;
+}
+
+bool CompileProfile::enabled() {
+    return profileRoot() != nullptr && *profileRoot() != '\0';
+}
+
+CompileProfile::CompileProfile(const std::string& kernelName, const AssumptionList& assumptions) : kernelName(kernelName) {
+    raw_string_ostream hs(hash);
+    hs << format_hex_no_prefix(hashAssumptions(assumptions), 16);
+    hs.flush();
+    dir = std::string(profileRoot()) + "/" + kernelName + "/" + hash;
+    std::error_code EC = sys::fs::create_directories(dir);
+    if(EC) {
+      errs() << "CompileProfile: cannot create " << dir << ": " << EC.message() << "\n";
+      return;
+    }
+    raw_fd_ostream os(dir + "/assumptions.txt", EC, sys::fs::F_Text);
+    for(auto a=assumptions.begin(),e=assumptions.end(); a!=e; ++a)
+      os << (*a)->describe() << "\n";
+}
+
+void CompileProfile::begin(const Module* M) {
+    startInsts = M ? countInstructions(*M) : 0;
+    started = Clock::now();
+}
+
+void CompileProfile::end(const std::string& stage, const Module* M) {
+    double ms = std::chrono::duration<double, std::milli>(Clock::now() - started).count();
+    records.push_back(Record{stage, ms, startInsts, M ? countInstructions(*M) : 0});
+}
+
+void CompileProfile::end(const std::string& stage, const std::string& ptx) {
+    double ms = std::chrono::duration<double, std::milli>(Clock::now() - started).count();
+    records.push_back(Record{stage, ms, -1, countPTXInstructions(ptx)});
+}
+
+void CompileProfile::record(const std::string& stage, double ms, long after) {
+    records.push_back(Record{stage, ms, -1, after});
+}
+
+void CompileProfile::dumpModule(const char* file, const Module& M) {
+    std::error_code EC;
+    raw_fd_ostream os(dir + "/" + file, EC, sys::fs::F_Text);
+    if(EC) {
+      errs() << "CompileProfile: cannot write " << file << ": " << EC.message() << "\n";
+      return;
+    }
+    M.print(os, nullptr);
+}
+
+void CompileProfile::dumpPTX(const std::string& ptx) {
+    std::error_code EC;
+    raw_fd_ostream os(dir + "/kernel.ptx", EC, sys::fs::F_Text);
+    if(EC) {
+      errs() << "CompileProfile: cannot write kernel.ptx: " << EC.message() << "\n";
+      return;
+    }
+    os << ptx;
+}
+
+void CompileProfile::finish() {
+    std::error_code EC;
+    {
+      raw_fd_ostream os(dir + "/passes.tsv", EC, sys::fs::F_Text);
+      for(auto r=records.begin(),e=records.end(); r!=e; ++r)
+        os << r->stage << "\t" << format("%.3f", r->ms) << "\t" << r->before << "\t" << r->after << "\n";
+    }
+
+    // Compiles can finish on several threads at once
+    std::lock_guard<std::mutex> guard(summaryLock);
+    raw_fd_ostream os(std::string(profileRoot()) + "/passes.tsv", EC, sys::fs::F_Append | sys::fs::F_Text);
+    if(EC) {
+      errs() << "CompileProfile: cannot append to passes.tsv: " << EC.message() << "\n";
+      return;
+    }
+    for(auto r=records.begin(),e=records.end(); r!=e; ++r)
+      os << kernelName << "\t" << hash << "\t" << r->stage << "\t" << format("%.3f", r->ms)
+         << "\t" << r->before << "\t" << r->after << "\n";
+}
+
+long CompileProfile::countInstructions(const Module& M) {
+    long n = 0;
+    for(auto F=M.begin(),e=M.end(); F!=e; ++F)
+      for(auto B=F->begin(),e=F->end(); B!=e; ++B)
+        n += B->size();
+    return n;
+}
+
+long CompileProfile::countPTXInstructions(const std::string& ptx) {
+    // Statements end in ';', directives start with '.', comments with '/'
+    long n = 0;
+    size_t pos = 0;
+    while(pos < ptx.size()) {
+      size_t eol = ptx.find('\n', pos);
+      if(eol == std::string::npos)
+        eol = ptx.size();
+      size_t first = ptx.find_first_not_of(" \t", pos);
+      size_t last = ptx.find_last_not_of(" \t\r", eol - 1);
+      if(first < eol && last != std::string::npos && last >= first &&
+         ptx[last] == ';' && ptx[first] != '.' && ptx[first] != '/')
+        ++n;
+      pos = eol + 1;
+    }
+    return n;
+}
@@ -0,0 +1,65 @@
+#ifndef _COMPILEPROFILE_H_
+#define _COMPILEPROFILE_H_
+
+#include "llvm/IR/Module.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "Assumption.h"
+
+/*
+ * Opt-in profiling of KernelFunction compiles, enabled by setting
+ * GPUJIT_PROFILE_DIR. Each compile records per-stage timing and instruction
+ * counts, and dumps its artifacts under
+ *   $GPUJIT_PROFILE_DIR/<kernel>/<assumption hash>/
+ *     assumptions.txt  pre.ll  post.ll  kernel.ptx  passes.tsv
+ * Every record is also appended to $GPUJIT_PROFILE_DIR/passes.tsv, which
+ * profile_summary reads.
+ */
+class CompileProfile {
+  public:
+    struct Record {
+      std::string stage;
+      double ms;
+      long before;
+      long after;
+    };
+  private:
+    typedef std::chrono::steady_clock Clock;
+    std::string kernelName;
+    std::string hash;
+    std::string dir;
+    std::vector<Record> records;
+    Clock::time_point started;
+    long startInsts = 0;
+
+  public:
+    static bool enabled();
+    CompileProfile(const std::string& kernelName, const AssumptionList& assumptions);
+    /*
+     * Time a stage: begin() snapshots the instruction count of M, end()
+     * records the elapsed time and the count afterward. Passing the PTX to
+     * end() records a PTX instruction count, which isn't comparable to the
+     * IR count, so before is recorded as -1 (no delta).
+     */
+    void begin(const llvm::Module* M);
+    void end(const std::string& stage, const llvm::Module* M);
+    void end(const std::string& stage, const std::string& ptx);
+    /*
+     * Record a stage timed elsewhere; -1 marks a count as unknown
+     */
+    void record(const std::string& stage, double ms, long after = -1);
+    void dumpModule(const char* file, const llvm::Module& M);
+    void dumpPTX(const std::string& ptx);
+    /*
+     * Write this compile's records to its directory and the global summary
+     */
+    void finish();
+
+    static long countInstructions(const llvm::Module& M);
+    static long countPTXInstructions(const std::string& ptx);
+};
+
+#endif
@@ -0,0 +1,121 @@
+#include "llvm/Support/SHA1.h"
+#include "CompileProtocol.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace CompileProtocol {
+
+// Refuse anything larger than this from the other end
+static const uint64_t MaxPayload = 1ULL << 30;
+
+std::string socketPath() {
+    const char* path = getenv("GPUJIT_COMPILE_SOCKET");
+    return path ? path : "";
+}
+
+std::string digest(const char* data, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    auto sha = llvm::SHA1::hash(llvm::ArrayRef<uint8_t>((const uint8_t*)data, len));
+    std::string out;
+    for(auto b=sha.begin(),e=sha.end(); b!=e; ++b) {
+      out += hex[*b >> 4];
+      out += hex[*b & 0xf];
+    }
+    return out;
+}
+
+static bool writeAll(int fd, const void* buf, size_t len) {
+    const char* p = (const char*)buf;
+    while(len > 0) {
+      // A peer that hung up is an error to report, not a SIGPIPE
+      ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+      if(n < 0 && errno == EINTR)
+        continue;
+      if(n <= 0)
+        return false;
+      p += n;
+      len -= n;
+    }
+    return true;
+}
+
+static bool readAll(int fd, void* buf, size_t len) {
+    char* p = (char*)buf;
+    while(len > 0) {
+      ssize_t n = read(fd, p, len);
+      if(n < 0 && errno == EINTR)
+        continue;
+      if(n <= 0)
+        return false;
+      p += n;
+      len -= n;
+    }
+    return true;
+}
+
+template<typename T>
+static bool writeValue(int fd, T v) {
+    return writeAll(fd, &v, sizeof(v));
+}
+
+template<typename T>
+static bool readValue(int fd, T& v) {
+    return readAll(fd, &v, sizeof(v));
+}
+
+static bool writeString(int fd, const std::string& s) {
+    return writeValue<uint64_t>(fd, s.size()) && writeAll(fd, s.data(), s.size());
+}
+
+static bool readString(int fd, std::string& s) {
+    uint64_t len;
+    if(!readValue(fd, len) || len > MaxPayload)
+      return false;
+    s.resize(len);
+    return len == 0 || readAll(fd, &s[0], len);
+}
+
+bool writeRequest(int fd, const Request& req) {
+    if(!writeValue(fd, Magic) || !writeString(fd, req.bitcodeDigest) ||
+       !writeString(fd, req.kernel) || !writeString(fd, req.arch) ||
+       !writeValue<uint32_t>(fd, req.keys.size()))
+      return false;
+    for(auto k=req.keys.begin(),e=req.keys.end(); k!=e; ++k) {
+      if(!writeValue(fd, k->kind) || !writeValue(fd, k->dim) || !writeValue(fd, k->aux) ||
+         !writeValue(fd, k->value) || !writeValue(fd, k->value2))
+        return false;
+    }
+    return writeString(fd, req.bitcode);
+}
+
+bool readRequest(int fd, Request& req) {
+    uint32_t magic, nkeys;
+    if(!readValue(fd, magic) || magic != Magic || !readString(fd, req.bitcodeDigest) ||
+       !readString(fd, req.kernel) || !readString(fd, req.arch) ||
+       !readValue(fd, nkeys) || nkeys > 4096)
+      return false;
+    req.keys.resize(nkeys);
+    for(auto k=req.keys.begin(),e=req.keys.end(); k!=e; ++k) {
+      if(!readValue(fd, k->kind) || !readValue(fd, k->dim) || !readValue(fd, k->aux) ||
+         !readValue(fd, k->value) || !readValue(fd, k->value2))
+        return false;
+    }
+    return readString(fd, req.bitcode);
+}
+
+bool writeResponse(int fd, Status status, const std::string& ptx, int32_t coarsened) {
+    return writeValue<uint32_t>(fd, status) && writeValue(fd, coarsened) && writeString(fd, ptx);
+}
+
+bool readResponse(int fd, Status& status, std::string& ptx, int32_t& coarsened) {
+    uint32_t s;
+    if(!readValue(fd, s) || !readValue(fd, coarsened) || !readString(fd, ptx))
+      return false;
+    status = (Status)s;
+    return true;
+}
+
+}
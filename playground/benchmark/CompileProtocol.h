@@ -0,0 +1,47 @@
+#ifndef _COMPILEPROTOCOL_H_
+#define _COMPILEPROTOCOL_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "Assumption.h"
+
+/*
+ * Wire format between KernelFunction and compile_server, over a Unix
+ * domain socket. Both ends run on the same node, so integers are sent in
+ * host byte order.
+ *
+ * Request:  magic, bitcode digest, kernel name, arch, assumption keys,
+ *           bitcode (may be empty if the server is expected to have it)
+ * Response: status, coarsening factor applied, PTX (when status is OK)
+ */
+namespace CompileProtocol {
+  const uint32_t Magic = 0x474a4333; // "GJC3"
+  enum Status : uint32_t {OK = 0, NeedBitcode = 1, Failed = 2};
+
+  struct Request {
+    std::string bitcodeDigest;
+    std::string kernel;
+    std::string arch;
+    std::vector<AssumptionKey> keys;
+    std::string bitcode;
+  };
+
+  /*
+   * Socket path from GPUJIT_COMPILE_SOCKET, or empty when unset
+   */
+  std::string socketPath();
+  /*
+   * SHA-1 of data as hex. The server trusts cached PTX by this digest, so
+   * it must not be forgeable the way a plain hash is.
+   */
+  std::string digest(const char* data, size_t len);
+
+  bool writeRequest(int fd, const Request& req);
+  bool readRequest(int fd, Request& req);
+  bool writeResponse(int fd, Status status, const std::string& ptx, int32_t coarsened);
+  bool readResponse(int fd, Status& status, std::string& ptx, int32_t& coarsened);
+}
+
+#endif
@@ -10,6 +10,7 @@
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
 #include "llvm/MC/SubtargetFeature.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/CodeGen.h"
@@ -21,9 +22,19 @@
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetSubtargetInfo.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "KernelFunction.h"
+#include "CompileClient.h"
+#include "CompileProfile.h"
+#include "CompileProtocol.h"
 
+#include <algorithm>
+#include <climits>
+#include <chrono>
 #include <iostream>
 #include <unistd.h>
 #include <pthread.h>
@@ -58,6 +69,39 @@ void KernelFunction::CUDAInit() {
     nvtxRangePop();
 }
 
+std::string KernelFunction::deviceArch() {
+    static std::string arch;
+    if(!arch.empty())
+        return arch;
+    if(!doneCUDAInit)
+        CUDAInit();
+    CUdevice d;
+    int major = 0, minor = 0;
+    if(cuDeviceGet(&d, 0) != CUDA_SUCCESS ||
+       cuDeviceGetAttribute(&major, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR, d) != CUDA_SUCCESS ||
+       cuDeviceGetAttribute(&minor, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR, d) != CUDA_SUCCESS) {
+        errs() << "Error querying CUDA device architecture\n";
+        return "";
+    }
+    arch = "sm_" + std::to_string(major) + std::to_string(minor);
+    return arch;
+}
+
+int KernelFunction::smCount() {
+    static int count = 0;
+    if(count)
+        return count;
+    if(!doneCUDAInit)
+        CUDAInit();
+    CUdevice d;
+    if(cuDeviceGet(&d, 0) != CUDA_SUCCESS ||
+       cuDeviceGetAttribute(&count, CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT, d) != CUDA_SUCCESS) {
+        errs() << "Error querying CUDA multiprocessor count\n";
+        count = 1;
+    }
+    return count;
+}
+
 void KernelFunction::LLVMInit() {
   nvtxRangePush("LLVMInit");
   InitializeAllTargets();
@@ -82,9 +126,85 @@ void KernelFunction::LLVMInit() {
   nvtxRangePop();
 }
 
-std::string* KernelFunction::moduleToPTX(Module &M) {
-  if(!doneLLVMInit)
-      LLVMInit();
+namespace {
+/*
+ * Codegen pass manager that times every pass added to it. Each pass is
+ * followed by a marker pass charging it the time since the previous
+ * marker, the same way -print-after-all interleaves printers. A module
+ * pass gets a module-level marker, so its time isn't charged to the
+ * function pass that runs after it.
+ */
+class TimedPassManager : public legacy::PassManager {
+    struct FunctionMarker : public FunctionPass {
+      static char ID;
+      TimedPassManager* PM;
+      unsigned stage;
+      FunctionMarker(TimedPassManager* PM, unsigned stage) : FunctionPass(ID), PM(PM), stage(stage) {}
+      void getAnalysisUsage(AnalysisUsage& AU) const override {AU.setPreservesAll();}
+      bool runOnFunction(Function&) override {PM->charge(stage); return false;}
+      StringRef getPassName() const override {return "Codegen timing marker";}
+    };
+    struct ModuleMarker : public ModulePass {
+      static char ID;
+      TimedPassManager* PM;
+      unsigned stage;
+      ModuleMarker(TimedPassManager* PM, unsigned stage) : ModulePass(ID), PM(PM), stage(stage) {}
+      void getAnalysisUsage(AnalysisUsage& AU) const override {AU.setPreservesAll();}
+      bool runOnModule(Module&) override {PM->charge(stage); return false;}
+      StringRef getPassName() const override {return "Codegen module timing marker";}
+    };
+    typedef std::chrono::steady_clock Clock;
+    std::vector<std::string> names;
+    std::vector<double> ms;
+    Clock::time_point last;
+
+  public:
+    void add(Pass* P) override {
+      // The manager may delete P when it's an analysis that already exists.
+      // Immutable passes never run, so there's nothing to time.
+      PassKind kind = P->getPassKind();
+      bool timed = kind != PT_PassManager && !P->getAsImmutablePass();
+      bool moduleLevel = kind == PT_Module || kind == PT_CallGraphSCC;
+      std::string name = P->getPassName().str();
+      legacy::PassManager::add(P);
+      if(!timed)
+        return;
+      names.push_back(name);
+      ms.push_back(0);
+      if(moduleLevel)
+        legacy::PassManager::add(new ModuleMarker(this, names.size() - 1));
+      else
+        legacy::PassManager::add(new FunctionMarker(this, names.size() - 1));
+    }
+    bool runTimed(Module& M) {
+      last = Clock::now();
+      return run(M);
+    }
+    void charge(unsigned stage) {
+      Clock::time_point now = Clock::now();
+      ms[stage] += std::chrono::duration<double, std::milli>(now - last).count();
+      last = now;
+    }
+    /*
+     * Record each pass, and what's left of total as "codegen other"
+     */
+    void report(CompileProfile& prof, double total, long ptxInsts) const {
+      for(unsigned i=0; i<names.size(); ++i) {
+        prof.record("codegen " + names[i], ms[i]);
+        total -= ms[i];
+      }
+      prof.record("codegen other", total, ptxInsts);
+    }
+};
+char TimedPassManager::FunctionMarker::ID = 0;
+char TimedPassManager::ModuleMarker::ID = 0;
+}
+
+std::string* KernelFunction::moduleToPTX(Module &M, const std::string& arch, CodeGenOpt::Level OLvl, CompileProfile* prof) {
+  // compile_server generates PTX on several threads at once
+  static std::once_flag initialized;
+  std::call_once(initialized, LLVMInit);
+  auto started = std::chrono::steady_clock::now();
 
   SMDiagnostic Err;
 
@@ -101,8 +221,7 @@ std::string* KernelFunction::moduleToPTX(Module &M) {
     return nullptr;
   }
 
-  std::string CPUStr = "", FeaturesStr = "";
-  CodeGenOpt::Level OLvl = CodeGenOpt::Default;
+  std::string CPUStr = arch, FeaturesStr = "";
 
   TargetOptions Options;
   Options.MCOptions.ShowMCEncoding = false;
@@ -121,8 +240,11 @@ std::string* KernelFunction::moduleToPTX(Module &M) {
   // creation.
 
 
-  // Build up all of the passes that we want to do to the module.
-  legacy::PassManager PM;
+  // Build up all of the passes that we want to do to the module. When
+  // profiling, time each of them.
+  TimedPassManager* timed = prof ? new TimedPassManager : nullptr;
+  std::unique_ptr<legacy::PassManager> OwnedPM(timed ? timed : new legacy::PassManager);
+  legacy::PassManager& PM = *OwnedPM;
 
   // Add an appropriate TargetLibraryInfo pass for the module's triple.
   TargetLibraryInfoImpl TLII(Triple(M.getTargetTriple()));
@@ -139,9 +261,17 @@ std::string* KernelFunction::moduleToPTX(Module &M) {
     return nullptr;
   }
 
-  PM.run(M);
+  if(timed)
+    timed->runTimed(M);
+  else
+    PM.run(M);
 
-  return new std::string(Buffer.begin(),Buffer.end());
+  std::string* ptx = new std::string(Buffer.begin(),Buffer.end());
+  if(timed) {
+    double total = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    timed->report(*prof, total, CompileProfile::countPTXInstructions(*ptx));
+  }
+  return ptx;
 }
 
 const Module& KernelFunction::getModule() {
@@ -150,6 +280,7 @@ const Module& KernelFunction::getModule() {
 }
 
 KernelFunction::KernelFunction(void *bitcode, size_t len) {
+    std::lock_guard<std::mutex> guard(llvmLock);
     auto ir_buffer = MemoryBuffer::getMemBuffer(StringRef((char*)bitcode, len), "<internal>", false);
     SMDiagnostic error;
     auto module = parseIR(MemoryBufferRef(*ir_buffer), error, Context);
@@ -162,9 +293,15 @@ KernelFunction::KernelFunction(void *bitcode, size_t len) {
     }
     this->module = std::move(module);
     this->fnName = "";
+    // Keep the bitcode around to hand to the compile server
+    if(CompileClient::enabled()) {
+        this->bitcode.assign((char*)bitcode, len);
+        this->bitcodeDigest = CompileProtocol::digest((char*)bitcode, len);
+    }
 }
 
 KernelFunction::KernelFunction(void *bitcode, size_t len, std::string fnName) {
+    std::lock_guard<std::mutex> guard(llvmLock);
     auto ir_buffer = MemoryBuffer::getMemBuffer(StringRef((char*)bitcode, len), "<internal>", false);
     SMDiagnostic error;
     auto module = parseIR(MemoryBufferRef(*ir_buffer), error, Context);
@@ -177,13 +314,71 @@ KernelFunction::KernelFunction(void *bitcode, size_t len, std::string fnName) {
     }
     this->module = std::move(module);
     this->fnName = fnName;
+    // Keep the bitcode around to hand to the compile server
+    if(CompileClient::enabled()) {
+        this->bitcode.assign((char*)bitcode, len);
+        this->bitcodeDigest = CompileProtocol::digest((char*)bitcode, len);
+    }
+}
+
+KernelFunction::~KernelFunction() {
+    std::lock_guard<std::mutex> guard(llvmLock);
+    module.reset();
+    libraries.clear();
+    libraryModules.clear();
+}
+
+std::shared_ptr<const Module> KernelFunction::parseLibrary(const void* bitcode, size_t len, const std::string& name) {
+    // The buffer's name becomes the module identifier, used in link errors
+    auto ir_buffer = MemoryBuffer::getMemBuffer(StringRef((const char*)bitcode, len), name, false);
+    SMDiagnostic error;
+    std::lock_guard<std::mutex> guard(llvmLock);
+    auto lib = parseIR(MemoryBufferRef(*ir_buffer), error, Context);
+    if(!lib) {
+        error.print("Error parsing device library", errs());
+        return nullptr;
+    }
+    return std::shared_ptr<const Module>(std::move(lib));
+}
+
+std::shared_ptr<const Module> KernelFunction::parseLibraryFile(const std::string& path) {
+    auto buffer = MemoryBuffer::getFile(path);
+    if(!buffer) {
+        errs() << "Error reading library " << path << ": " << buffer.getError().message() << "\n";
+        return nullptr;
+    }
+    return parseLibrary((*buffer)->getBufferStart(), (*buffer)->getBufferSize(), path);
+}
+
+void KernelFunction::addLibrary(std::shared_ptr<const Module> library) {
+    libraries.push_back(library.get());
+    libraryModules.push_back(std::move(library));
+}
+
+bool KernelFunction::addLibrary(const void* bitcode, size_t len) {
+    std::shared_ptr<const Module> lib = parseLibrary(bitcode, len);
+    if(!lib)
+        return false;
+    addLibrary(std::move(lib));
+    return true;
+}
+
+bool KernelFunction::addLibraryFile(const std::string& path) {
+    std::shared_ptr<const Module> lib = parseLibraryFile(path);
+    if(!lib)
+        return false;
+    addLibrary(std::move(lib));
+    return true;
 }
 
-std::string KernelFunction::getKernelName() {
+const std::string& KernelFunction::getKernelName() {
+    // Remember the first annotated kernel so later calls are free
     if(!fnName.empty())
         return fnName;
     const Module& M = getModule();
     auto nvvmAnnot = M.getNamedMetadata("nvvm.annotations");
+    if(!nvvmAnnot)
+        return fnName;
     for(auto a = nvvmAnnot->op_begin(),e = nvvmAnnot->op_end(); a!=e; ++a) {
       if((*a)->getNumOperands() == 3) {
         if(auto t = dyn_cast<MDString>((*a)->getOperand(1))) {
@@ -192,12 +387,23 @@ std::string KernelFunction::getKernelName() {
             assert(v && "Kernel is value");
             auto kf = dyn_cast<Function>(v->getValue());
             assert(kf && "Kernel is a function");
-            return kf->getName();
+            fnName = kf->getName().str();
+            return fnName;
           }
         }
       }
     }
-    return "";
+    return fnName;
+}
+
+bool KernelFunction::hasKernel() {
+    if(!module)
+        return false;
+    const std::string& name = getKernelName();
+    if(name.empty())
+        return false;
+    const Function* K = module->getFunction(name);
+    return K && !K->isDeclaration();
 }
 
 CUfunction KernelFunction::getCUFunction(const CUmodule& M) {
@@ -212,10 +418,11 @@ CUfunction KernelFunction::getCUFunction(const CUmodule& M) {
 CUmodule KernelFunction::loadCUmodule(const std::string& ptx) {
     if(!doneCUDAInit)
         CUDAInit();
-    CUmodule mod;
+    CUmodule mod = nullptr;
     CUresult err = cuModuleLoadData(&mod, ptx.c_str());
     if(err != CUDA_SUCCESS) {
         errs() << "Error loading PTX module into CUDA\n";
+        return nullptr;
     }
     return mod;
 }
@@ -223,71 +430,278 @@ CUresult KernelFunction::launchKernel(
                       int gridX, int gridY, int gridZ,
                       int blockX, int blockY, int blockZ,
                       int smem, CUstream stream, void** params) {
-    CUmodule mod;
-    CUmodule* M = nullptr;
-    for(auto t=cumodules.begin(),e=cumodules.end(); t!=e; ++t) {
+    // Registering the track here, before any compile thread exists, keeps
+    // getTraceTrack() race-free
+    int64_t traceStart = 0;
+    if(Trace::enabled()) {
+        traceStart = Trace::now();
+        getTraceTrack();
+    }
+    if(!pinsResolved)
+        resolvePins(gridX, gridY, gridZ, blockX, blockY, blockZ, params);
+
+    // Dispatch to the most specialized variant whose assumptions hold
+    const Variant* V = nullptr;
+    unsigned n = numVariants.load(std::memory_order_acquire);
+    for(unsigned i=0; i<n; ++i) {
+      const Variant& v = variants[i];
+      if(V && v.assumptions.size() <= V->assumptions.size())
+        continue;
       bool valid = true;
-      for(auto a=t->first.begin(),e=t->first.end(); a!=e; ++a) {
+      for(auto a=v.assumptions.begin(),e=v.assumptions.end(); a!=e; ++a) {
         if(!(*a)->holds(gridX, gridY, gridZ, blockX, blockY, blockZ, smem, params)) {
           valid = false;
           break;
         }
       }
-      if(valid) {
-        M = &(t->second);
-        break;
-      }
+      if(valid)
+        V = &v;
     }
-    if(M == nullptr) {
-        // Generate the default module synchronously
-        AssumptionList assumptions;
-        mod = compileModule(assumptions, &getModule());
-        cumodules.insert(make_pair(assumptions, mod));
-        M = &mod;
+    CUfunction func = V ? V->function : nullptr;
+    int coarsen = V ? V->coarsen : 1;
+    if(V == nullptr) {
+        // Generate the first module synchronously, honouring pinned hints.
+        // Any later miss means a pinned hint was wrong: fall back to generic.
+        AssumptionTable::Mask mask;
+        bool first = numVariants == 0;
+        if(first) {
+            mask = table.getPinned();
+        } else {
+            errs() << getKernelName() << ": Launch breaks pinned hints, compiling generic module.\n";
+            table.clearPins();
+        }
+        table.retain(mask);
+        AssumptionList assumptions = table.select(mask);
+        int factor = 1;
+        int64_t compileStart = Trace::enabled() ? Trace::now() : 0;
+        CUmodule mod = compileModule(assumptions, &factor);
+        if(!mod && mask.any()) {
+            errs() << getKernelName() << ": Specialized compile failed, compiling generic module.\n";
+            table.clearPins();
+            table.release(mask);
+            mask.reset();
+            assumptions.clear();
+            mod = compileModule(assumptions, &factor);
+        }
+        V = publishVariant(assumptions, mask, mod, factor);
+        if(!V)
+            table.release(mask);
+        if(Trace::enabled())
+            Trace::complete(getTraceTrack(), first ? "first-launch compile" : "fallback compile",
+                            compileStart, V ? V - variants : -1, summarize(assumptions).c_str());
+        if(!mod) {
+            // Nothing to launch; leave the kernel to the caller
+            errs() << getKernelName() << ": No module compiled, not launching.\n";
+            compileFailed = true;
+            unlaunchable = true;
+            return CUDA_ERROR_INVALID_PTX;
+        }
+        func = V ? V->function : getCUFunction(mod);
+        coarsen = V ? V->coarsen : factor;
     }
     // Propose Assumptions
     proposeAssumptions(gridX, gridY, gridZ, blockX, blockY, blockZ, smem, params);
     // Update Assumptions
-    for(auto a=allAssumptions.begin(),e=allAssumptions.end(); a!=e; ++a) {
-        (*a)->update_assumption(gridX, gridY, gridZ, blockX, blockY, blockZ, smem, params);
-    }
+    table.update(gridX, gridY, gridZ, blockX, blockY, blockZ, smem, params);
     // Trigger possible recompilation
     compileLikelyModule();
 
-    return cuLaunchKernel(getCUFunction(*M), gridX, gridY, gridZ, blockX, blockY, blockZ, smem, stream, params, NULL);
+    CUresult result = cuLaunchKernel(func, gridX / coarsen, gridY, gridZ, blockX, blockY, blockZ, smem, stream, params, NULL);
+    if(Trace::enabled())
+        Trace::complete(getTraceTrack(), "launch", traceStart, V ? V - variants : -1);
+    return result;
 }
 
-CUmodule KernelFunction::compileModule(const AssumptionList& assumptions, const llvm::Module* orig_module) {
-    compiling = true;
+const KernelFunction::Variant* KernelFunction::publishVariant(const AssumptionList& assumptions, const AssumptionTable::Mask& mask, CUmodule mod, int coarsen) {
+    if(!mod)
+        return nullptr;
+    std::lock_guard<std::mutex> guard(publishing);
+    unsigned n = numVariants.load(std::memory_order_relaxed);
+    if(n == MaxVariants) {
+        errs() << getKernelName() << ": Variant limit reached, dropping compiled module.\n";
+        cuModuleUnload(mod);
+        return nullptr;
+    }
+    Variant& v = variants[n];
+    v.assumptions = assumptions;
+    v.mask = mask;
+    v.module = mod;
+    v.function = getCUFunction(mod);
+    // What the compile applied, which may be less than was asked for
+    v.coarsen = coarsen;
+    // Readers only look below numVariants, so this makes v visible
+    numVariants.store(n + 1, std::memory_order_release);
+    if(Trace::enabled())
+        Trace::instant(getTraceTrack(), "variant live", n, summarize(assumptions).c_str());
+    return &v;
+}
+
+CUmodule KernelFunction::compileModule(const AssumptionList& assumptions, int* coarsened) {
     nvtxRangePush("compileModule");
+    std::unique_ptr<CompileProfile> prof;
+    if(CompileProfile::enabled())
+        prof.reset(new CompileProfile(getKernelName(), assumptions));
+
+    // Prefer the node's compile server, which shares work across processes
+    std::string arch = deviceArch();
+    std::string* ptx = nullptr;
+    // The server only has the kernel's own bitcode, not our libraries
+    if(CompileClient::enabled() && libraries.empty()) {
+        if(prof) prof->begin(nullptr);
+        ptx = CompileClient::compile(bitcode, bitcodeDigest, getKernelName(), arch, assumptions, coarsened);
+        if(prof && ptx) prof->end("compile server", *ptx);
+    }
+    if(!ptx) {
+        std::lock_guard<std::mutex> guard(llvmLock);
+        ptx = compilePTX(assumptions, &getModule(), getKernelName(), arch, prof.get(), libraries, coarsened);
+    }
+    if(!ptx) {
+        errs() << getKernelName() << ": Compile failed.\n";
+        nvtxRangePop();
+        return nullptr;
+    }
+
+    nvtxRangePush("PTX to SASS");
+    if(prof) prof->begin(nullptr);
+    CUmodule cumod = loadCUmodule(*ptx);
+    if(prof) prof->end("PTX to SASS", nullptr);
+    nvtxRangePop();
+    delete ptx;
+    nvtxRangePop();
+    if(prof) prof->finish();
+    return cumod;
+}
+
+std::string* KernelFunction::compilePTX(const AssumptionList& assumptions, const llvm::Module* orig_module,
+                                        const std::string& kernelName, const std::string& arch,
+                                        CompileProfile* prof,
+                                        const std::vector<const llvm::Module*>& libraries,
+                                        int* coarsened) {
+    if(coarsened)
+        *coarsened = 1;
     // Make our own copy of the module
+    if(prof) prof->begin(orig_module);
     std::unique_ptr<llvm::Module> M = CloneModule(orig_module);
+    if(prof) prof->end("CloneModule", &*M);
+
+    // Pull in the library functions the kernel calls, then make everything
+    // but the kernel internal so they can be inlined, specialized with it,
+    // and dropped when unused
+    if(!libraries.empty()) {
+        if(prof) prof->begin(&*M);
+        bool linked = linkLibraries(*M, libraries, true);
+        if(prof) prof->end("link libraries", &*M);
+        if(!linked)
+            return nullptr;
+        if(prof) prof->begin(&*M);
+        stripModule(*M, *orig_module, kernelName);
+        if(prof) prof->end("internalize+GlobalDCE", &*M);
+    }
+    if(prof) prof->dumpModule("pre.ll", *M);
+    Function* K = M->getFunction(kernelName);
+    if(!K) {
+        errs() << "Kernel " << kernelName << " missing from module\n";
+        return nullptr;
+    }
 
-    // Apply any assumptions
+    // Apply any assumptions. Coarsening rewrites the geometry reads the
+    // others rely on, so it goes last, and only the first factor is used.
     nvtxRangePush("JIT Optimizations");
+    bool changed = false;
+    const CoarsenAssumption* coarsen = nullptr;
     for(auto a=assumptions.begin(),e=assumptions.end(); a!=e; ++a) {
-        (*a)->apply(&*M);
+        if(auto c = dyn_cast<CoarsenAssumption>(&**a)) {
+            if(!coarsen)
+                coarsen = c;
+            continue;
+        }
+        if(prof) prof->begin(&*M);
+        changed |= (*a)->apply(K);
+        if(prof) prof->end("apply " + (*a)->describe(), &*M);
+    }
+    if(coarsen) {
+        if(prof) prof->begin(&*M);
+        // A refused rewrite leaves the kernel expecting the full grid
+        bool applied = coarsen->apply(K);
+        if(prof) prof->end("apply " + coarsen->describe(), &*M);
+        if(applied && coarsened)
+            *coarsened = coarsen->getFactor();
+        changed |= applied;
     }
+    // Fold whatever the assumptions exposed before handing off to codegen
+    if(changed)
+        simplifyModule(*M, prof);
     nvtxRangePop();
+    if(prof) prof->dumpModule("post.ll", *M);
 
     // Run compilation flow
     nvtxRangePush("LLVM to PTX");
-    std::string* ptx = moduleToPTX(*M);
-    nvtxRangePop();
-    assert(ptx != nullptr);
-    nvtxRangePush("PTX to SASS");
-    CUmodule cumod = loadCUmodule(*ptx);
+    std::string* ptx = moduleToPTX(*M, arch, CodeGenOpt::Default, prof);
     nvtxRangePop();
-    delete ptx;
-    nvtxRangePop();
-    compiling = false;
-    return cumod;
+    if(prof && ptx) prof->dumpPTX(*ptx);
+    return ptx;
+}
+
+bool KernelFunction::linkLibraries(Module& M, const std::vector<const llvm::Module*>& libraries, bool onlyNeeded) {
+    for(auto l=libraries.begin(),e=libraries.end(); l!=e; ++l) {
+        // The linker consumes its source, so link a copy
+        std::unique_ptr<llvm::Module> lib = CloneModule(*l);
+        // Libraries like libdevice ship without a triple; don't let that warn
+        lib->setTargetTriple(M.getTargetTriple());
+        lib->setDataLayout(M.getDataLayout());
+        if(Linker::linkModules(M, std::move(lib), onlyNeeded ? Linker::Flags::LinkOnlyNeeded : Linker::Flags::None)) {
+            errs() << "Error linking device library " << (*l)->getModuleIdentifier() << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+void KernelFunction::stripModule(Module& M, const Module& orig, const std::string& kernelName) {
+    // Keep the kernel, and the module's own globals the host may look up by name
+    internalizeModule(M, [&](const GlobalValue& GV) {
+        return GV.getName() == kernelName ||
+               (isa<GlobalVariable>(GV) && orig.getGlobalVariable(GV.getName(), true));
+    });
+    legacy::PassManager PM;
+    PM.add(createFunctionInliningPass());
+    PM.add(createGlobalDCEPass());
+    PM.run(M);
+}
+
+void KernelFunction::simplifyModule(Module& M, CompileProfile* prof) {
+    // Codegen alone won't propagate constants or range facts through
+    // branches, so run a short cleanup over the specialized module
+    Pass* passes[] = {
+      createInstructionCombiningPass(),
+      createSCCPPass(),
+      createCorrelatedValuePropagationPass(),
+      createInstructionCombiningPass(),
+      createCFGSimplificationPass(),
+      createAggressiveDCEPass()
+    };
+    if(!prof) {
+      legacy::PassManager PM;
+      for(auto P : passes)
+        PM.add(P);
+      PM.run(M);
+      return;
+    }
+    // When profiling, run each pass on its own to attribute time and size
+    for(auto P : passes) {
+      std::string name = P->getPassName().str();
+      legacy::PassManager PM;
+      PM.add(P);
+      prof->begin(&M);
+      PM.run(M);
+      prof->end(name, &M);
+    }
 }
 
 struct compileModule_args {
     AssumptionList assumptions;
-    const llvm::Module* module;
-    CUModuleMap* cumodules;
+    AssumptionTable::Mask mask;
+    KernelFunction* kf;
     CUcontext ctx;
 };
 
@@ -301,21 +715,42 @@ void *KernelFunction::compileModuleAsync_thread(void *v_args) {
     struct compileModule_args* args = (struct compileModule_args*) v_args;
     cuCtxPushCurrent(args->ctx);
     // Perform the compilation
-    CUmodule cumodule = compileModule(args->assumptions, args->module);
+    int coarsen = 1;
+    int64_t traceStart = Trace::enabled() ? Trace::now() : 0;
+    CUmodule cumodule = args->kf->compileModule(args->assumptions, &coarsen);
     // Save the result
-    args->cumodules->insert(make_pair(args->assumptions, cumodule));
+    const Variant* V = args->kf->publishVariant(args->assumptions, args->mask, cumodule, coarsen);
+    // The launch thread keeps using the variants it has
+    if(!cumodule)
+        args->kf->compileFailed = true;
+    // Only the launch thread touches the table; it releases the mask
+    args->kf->asyncPublished = V != nullptr;
+    args->kf->asyncDone = true;
+    if(Trace::enabled())
+        Trace::complete(Trace::workerTrack(), "compile", traceStart, V ? V - args->kf->variants : -1,
+                        (args->kf->getKernelName() + ": " + summarize(args->assumptions)).c_str());
+    compiling = false;
     // We're done with the arguments
     delete v_args;
     return nullptr;
 }
 
-void KernelFunction::compileModuleAsync(AssumptionList assumptions) {
+void KernelFunction::compileModuleAsync(const AssumptionTable::Mask& mask) {
+    // The caller has claimed the compiler, so later launches don't queue
+    // the same work
     // Create the arguments
     struct compileModule_args* args = new compileModule_args;
-    args->assumptions = assumptions;
-    args->module = &getModule();
-    args->cumodules = &cumodules;
+    args->assumptions = table.select(mask);
+    args->mask = mask;
+    // The variant's mask must keep naming these entries
+    table.retain(mask);
+    asyncMask = mask;
+    asyncPending = true;
+    asyncDone = false;
+    args->kf = this;
     cuCtxGetCurrent(&args->ctx);
+    if(Trace::enabled())
+        Trace::instant(getTraceTrack(), "compile queued", -1, summarize(args->assumptions).c_str());
     pthread_t bg_thread;
     pthread_create(&bg_thread, NULL, KernelFunction::compileModuleAsync_thread, args);
 }
@@ -323,83 +758,287 @@ void KernelFunction::proposeAssumptions(
                         int gridX, int gridY, int gridZ,
                         int blockX, int blockY, int blockZ,
                         int smem, void** params) {
-    // Generate GeometryAssumptions
-    auto assumeGX = std::make_shared<GeometryAssumption>(GeometryAssumption::GridX, gridX);
-    auto assumeGY = std::make_shared<GeometryAssumption>(GeometryAssumption::GridY, gridY);
-    auto assumeGZ = std::make_shared<GeometryAssumption>(GeometryAssumption::GridZ, gridZ);
-    if(!hasAssumption(*assumeGX))
-      allAssumptions.push_back(assumeGX);
-    if(!hasAssumption(*assumeGY))
-      allAssumptions.push_back(assumeGY);
-    if(!hasAssumption(*assumeGZ))
-      allAssumptions.push_back(assumeGZ);
-
-    auto assumeBX = std::make_shared<GeometryAssumption>(GeometryAssumption::BlockX, blockX);
-    auto assumeBY = std::make_shared<GeometryAssumption>(GeometryAssumption::BlockY, blockY);
-    auto assumeBZ = std::make_shared<GeometryAssumption>(GeometryAssumption::BlockZ, blockZ);
-    if(!hasAssumption(*assumeBX))
-      allAssumptions.push_back(assumeBX);
-    if(!hasAssumption(*assumeBY))
-      allAssumptions.push_back(assumeBY);
-    if(!hasAssumption(*assumeBZ))
-      allAssumptions.push_back(assumeBZ);
-
-    // TODO: Generate additional assumptions
-    errs() << getKernelName() << ": Now has " << allAssumptions.size() << " possible assumptions.\n";
-}
-bool KernelFunction::hasAssumption(const Assumption& a) {
-    for(auto b=allAssumptions.begin(),e=allAssumptions.end(); b!=e; ++b) {
-      if(**b == a)
-          return true;
+    unsigned before = table.size();
+    // A grid dimension that has changed once follows the input, so an exact
+    // value for it would only produce one variant per input
+    int launchGrid[] = {gridX, gridY, gridZ};
+    for(int d=0; d<3; ++d) {
+      if(firstGrid[d] == 0)
+        firstGrid[d] = launchGrid[d];
+      else if(launchGrid[d] != firstGrid[d])
+        gridVaries[d] = true;
+    }
+
+    // Generate exact GeometryAssumptions
+    for(int d=GeometryAssumption::GridX; d<=GeometryAssumption::BlockZ; ++d) {
+      if(d <= GeometryAssumption::GridZ && gridVaries[d])
+        continue;
+      auto dim = (GeometryAssumption::Dim)d;
+      int v = GeometryAssumption::select(dim, gridX, gridY, gridZ, blockX, blockY, blockZ);
+      table.intern(GeometryAssumption::keyFor(dim, v));
+    }
+
+    // Grid sizes usually follow the input, so also propose assumptions that
+    // survive a change of input: a power-of-two bucket, and the largest
+    // power of two (up to 32) that divides the grid
+    for(int d=GeometryAssumption::GridX; d<=GeometryAssumption::GridZ; ++d) {
+      auto dim = (GeometryAssumption::Dim)d;
+      int v = GeometryAssumption::select(dim, gridX, gridY, gridZ, blockX, blockY, blockZ);
+      if(v <= 1)
+        continue;
+      table.intern(GeometryRangeAssumption::bucketFor(dim, v));
+      int factor = 1;
+      while(factor < 32 && v % (factor * 2) == 0)
+        factor *= 2;
+      if(factor > 1)
+        table.intern(GeometryMultipleAssumption::keyFor(dim, factor));
+    }
+
+    // Propose the value of a watched parameter once it repeats. Values that
+    // change every launch would only fill the table.
+    for(unsigned w=0; w<watchedParams.size(); ++w) {
+      unsigned p = watchedParams[w];
+      if(isForbidden(p))
+        continue;
+      int n = *(int*)params[p];
+      if(lastWatched[w] == n)
+        table.intern(ParamAssumption::keyFor(p, n));
+      lastWatched[w] = n;
     }
-    return false;
-}
 
+    // Relate the thread count to integer parameters that look like problem
+    // sizes
+    int grid[] = {gridX, gridY, gridZ};
+    int block[] = {blockX, blockY, blockZ};
+    const std::vector<unsigned>& ints = scalarIntParams();
+    for(auto p=ints.begin(),e=ints.end(); p!=e; ++p) {
+      if(isForbidden(*p))
+        continue;
+      long long n = *(int*)params[*p];
+      // One thread, or blocks of one, say nothing about a problem size
+      if(n <= 1)
+        continue;
+      for(int d=0; d<3; ++d) {
+        long long threads = (long long)grid[d] * block[d];
+        if(block[d] <= 1 || threads < n || threads - block[d] >= n)
+          continue;
+        // This grid is the smallest one covering n
+        table.intern(GridCoverageAssumption::keyFor(d, block[d], *p, GridCoverageAssumption::Covers));
+        if(threads == n)
+          table.intern(GridCoverageAssumption::keyFor(d, block[d], *p, GridCoverageAssumption::Within));
+      }
+    }
+
+    // Coarsen grids big enough that every SM still gets several blocks of
+    // the smaller grid
+    if(isCoarsenable()) {
+      for(int factor=8; factor>=2; factor/=2) {
+        if(gridX % factor == 0 && gridX / factor >= 4 * smCount()) {
+          table.intern(CoarsenAssumption::keyFor(factor));
+          break;
+        }
+      }
+    }
+
+    if(table.size() != before)
+      errs() << getKernelName() << ": Now has " << table.size() << " possible assumptions.\n";
+}
+const std::vector<unsigned>& KernelFunction::scalarIntParams() {
+    if(!scannedParams) {
+      if(const Function* K = getModule().getFunction(getKernelName())) {
+        unsigned i = 0;
+        for(auto A=K->arg_begin(),e=K->arg_end(); A!=e; ++A, ++i) {
+          if(A->getType()->isIntegerTy(32))
+            intParams.push_back(i);
+        }
+      }
+      scannedParams = true;
+    }
+    return intParams;
+}
+uint16_t KernelFunction::getTraceTrack() {
+    if(traceTrack < 0)
+      traceTrack = Trace::track(getKernelName());
+    return traceTrack;
+}
+std::string KernelFunction::summarize(const AssumptionList& assumptions) {
+    if(assumptions.empty())
+      return "generic";
+    std::string s;
+    for(auto a=assumptions.begin(),e=assumptions.end(); a!=e; ++a)
+      s += (a == assumptions.begin() ? "" : ", ") + (*a)->describe();
+    return s;
+}
+bool KernelFunction::isCoarsenable() {
+    if(!scannedCoarsen) {
+      coarsenable = CoarsenAssumption::canCoarsen(getModule().getFunction(getKernelName()));
+      scannedCoarsen = true;
+    }
+    return coarsenable;
+}
 void KernelFunction::compileLikelyModule() {
-    // Collect the list of safe assumptions
-    AssumptionList likely;
-    for(auto a=allAssumptions.begin(),e=allAssumptions.end(); a!=e; ++a) {
-        if((*a)->willHold() >= Assumption::Likely)
-            likely.push_back(*a);
+    // Let go of a finished compile's entries if it left no variant behind
+    if(asyncPending && asyncDone) {
+        if(!asyncPublished)
+            table.release(asyncMask);
+        asyncPending = false;
+    }
+    // Requests that will now never compile
+    if(compileFailed || numVariants >= maxVariants) {
+        for(auto m=requested.begin(),e=requested.end(); m!=e; ++m)
+            table.release(*m);
+        requested.clear();
+    }
+    if(compiling || compileFailed || numVariants >= maxVariants)
+        return;
+    // Claim the compiler; another kernel's launch thread may be racing us
+    bool idle = false;
+    if(!compiling.compare_exchange_strong(idle, true))
+        return;
+
+    // Explicitly requested variants go first, in the order requested
+    while(!requested.empty()) {
+        AssumptionTable::Mask mask = requested.front();
+        requested.erase(requested.begin());
+        if(!hasCompiledAssumptions(mask)) {
+            errs() << getKernelName() << ": Compiling requested variant.\n";
+            // The compile retains the mask in the request's place
+            compileModuleAsync(mask);
+            table.release(mask);
+            return;
+        }
+        table.release(mask);
     }
-    errs() << getKernelName() << ": " << likely.size() << " likely assumptions.\n";
 
+    // Collect the set of safe assumptions
+    AssumptionTable::Mask likely = table.likely();
+    if(gridVaries[0] || gridVaries[1] || gridVaries[2])
+        dropVaryingGrid(likely);
 
-    if(!hasCompiledAssumptions(likely) && !compiling) {
+    if(!hasCompiledAssumptions(likely)) {
         // Let's build a new module!
-        errs() << getKernelName() << ": Recompiling.\n";
+        errs() << getKernelName() << ": Recompiling with " << likely.count() << " likely assumptions.\n";
         compileModuleAsync(likely);
-    } else {
-        errs() << getKernelName() << ": Likely assumptions match existing compilation.\n";
-    }
-}
-
-bool KernelFunction::hasCompiledAssumptions(const AssumptionList& candidate) const {
-    // Check if we have this particular list compiled
-    // (This is terribly inefficient)
-    bool exists = false;
-    for(auto t=cumodules.begin(),e=cumodules.end(); t!=e; ++t) {
-      if(t->first.size() == candidate.size()) {
-          // potential match, ensure all our elements are contained
-          bool elems_match = true;
-          for(auto l=candidate.begin(),e=candidate.end(); l!=e && elems_match; ++l) {
-            bool e_match = false;
-            for(auto existing=t->first.begin(),e=t->first.end();existing!=e && !e_match; ++existing) {
-              if(**l == **existing)
-                  e_match = true;
+        return;
+    }
+    compiling = false;
+}
+
+void KernelFunction::pinParameter(unsigned index) {
+    const std::vector<unsigned>& ints = scalarIntParams();
+    if(std::find(ints.begin(), ints.end(), index) == ints.end()) {
+        errs() << getKernelName() << ": Parameter " << index << " is not a 32-bit integer, ignoring pin.\n";
+        return;
+    }
+    if(isForbidden(index)) {
+        errs() << getKernelName() << ": Parameter " << index << " is forbidden, ignoring pin.\n";
+        return;
+    }
+    pinnedParams.push_back(index);
+    pinsResolved = false;
+}
+
+void KernelFunction::pinDimension(GeometryAssumption::Dim dim) {
+    pinnedDims[dim] = true;
+    pinsResolved = false;
+}
+
+void KernelFunction::watchParameter(unsigned index) {
+    const std::vector<unsigned>& ints = scalarIntParams();
+    if(std::find(ints.begin(), ints.end(), index) == ints.end()) {
+        errs() << getKernelName() << ": Parameter " << index << " is not a 32-bit integer, ignoring watch.\n";
+        return;
+    }
+    watchedParams.push_back(index);
+    // No int equals this, so the first launch never counts as a repeat
+    lastWatched.push_back(LLONG_MIN);
+}
+
+void KernelFunction::forbidParameter(unsigned index) {
+    forbiddenParams.push_back(index);
+}
+
+void KernelFunction::requestVariant(const AssumptionList& assumptions) {
+    AssumptionTable::Mask mask;
+    const std::vector<unsigned>& ints = scalarIntParams();
+    for(auto a=assumptions.begin(),e=assumptions.end(); a!=e; ++a) {
+        if(isa<CoarsenAssumption>(&**a) && !isCoarsenable()) {
+            errs() << getKernelName() << ": Kernel is not safe to coarsen, ignoring requested variant.\n";
+            return;
+        }
+        // Both read the parameter as a 32-bit int when checking a launch
+        AssumptionKey k = (*a)->key();
+        if(k.kind == Assumption::AK_Param || k.kind == Assumption::AK_GridCoverage) {
+            if(std::find(ints.begin(), ints.end(), k.aux) == ints.end() || isForbidden(k.aux)) {
+                errs() << getKernelName() << ": Parameter " << k.aux
+                       << " is forbidden or not a 32-bit integer, ignoring requested variant.\n";
+                return;
             }
-            elems_match &= e_match;
-          }
-          if (elems_match) {
-            exists = true;
-            break;
-          }
-      }
+        }
+        int i = table.intern((*a)->key());
+        if(i < 0)
+            return;
+        mask.set(i);
+    }
+    table.retain(mask);
+    requested.push_back(mask);
+}
+
+void KernelFunction::setMaxVariants(unsigned n) {
+    maxVariants = std::min(std::max(n, 1u), MaxVariants);
+}
+
+bool KernelFunction::isForbidden(unsigned param) const {
+    return std::find(forbiddenParams.begin(), forbiddenParams.end(), param) != forbiddenParams.end();
+}
+
+void KernelFunction::resolvePins(int gridX, int gridY, int gridZ,
+                                 int blockX, int blockY, int blockZ, void** params) {
+    // Pinned values are whatever the first launch after the hint uses
+    for(int d=GeometryAssumption::GridX; d<=GeometryAssumption::BlockZ; ++d) {
+        if(!pinnedDims[d])
+            continue;
+        auto dim = (GeometryAssumption::Dim)d;
+        int v = GeometryAssumption::select(dim, gridX, gridY, gridZ, blockX, blockY, blockZ);
+        int i = table.intern(GeometryAssumption::keyFor(dim, v));
+        if(i >= 0)
+            table.pin(i);
     }
-    return exists;
+    for(auto p=pinnedParams.begin(),e=pinnedParams.end(); p!=e; ++p) {
+        // Forbidding wins over a pin given before it
+        if(isForbidden(*p))
+            continue;
+        int i = table.intern(ParamAssumption::keyFor(*p, *(int*)params[*p]));
+        if(i >= 0)
+            table.pin(i);
+    }
+    pinsResolved = true;
+}
+
+void KernelFunction::dropVaryingGrid(AssumptionTable::Mask& mask) const {
+    // Exact values interned before the grid started varying may still be
+    // Likely while one input lasts; leave them to the generalized ones
+    for(unsigned i=0; i<table.size(); ++i) {
+        if(!mask.test(i) || table.getPinned().test(i))
+            continue;
+        AssumptionKey k = table[i].key();
+        if(k.kind == Assumption::AK_Geometry && k.dim <= GeometryAssumption::GridZ && gridVaries[k.dim])
+            mask.reset(i);
+    }
+}
+
+bool KernelFunction::hasCompiledAssumptions(const AssumptionTable::Mask& candidate) const {
+    unsigned n = numVariants.load(std::memory_order_acquire);
+    for(unsigned i=0; i<n; ++i) {
+      if(variants[i].mask == candidate)
+          return true;
+    }
+    return false;
 }
 
-bool KernelFunction::compiling = false;
+const unsigned KernelFunction::MaxVariants;
+std::atomic<bool> KernelFunction::compiling(false);
+std::mutex KernelFunction::llvmLock;
 bool KernelFunction::doneLLVMInit = false;
 bool KernelFunction::doneCUDAInit = false;
 llvm::LLVMContext KernelFunction::Context;
@@ -1,27 +1,90 @@
+#ifndef _KERNELFUNCTION_H_
+#define _KERNELFUNCTION_H_
+
 #include "llvm/Pass.h"
 
 #include "llvm/IR/Module.h"
+#include "llvm/Support/CodeGen.h"
 
 #include <cuda.h>
 #include <nvToolsExt.h>
+#include <atomic>
+#include <mutex>
 #include <string>
 #include <vector>
-#include <map>
 
 #include "Assumption.h"
+#include "AssumptionTable.h"
+#include "Trace.h"
+
+class CompileProfile;
 
 
 class KernelFunction {
+  public:
+    static const unsigned MaxVariants = 16;
   private:
+    /*
+     * A compiled module, valid for launches where all its assumptions hold
+     */
+    struct Variant {
+      AssumptionList assumptions;
+      AssumptionTable::Mask mask;
+      CUmodule module;
+      CUfunction function;
+      // Launched with gridX/coarsen blocks
+      int coarsen;
+    };
     static bool doneLLVMInit;
     static bool doneCUDAInit;
-    static bool compiling;
+    static std::atomic<bool> compiling;
+    // Every KernelFunction shares Context, which isn't thread-safe: held for
+    // each parse, compile and module teardown in this process
+    static std::mutex llvmLock;
     static llvm::PassRegistry* Registry;
     static llvm::LLVMContext Context;
     std::unique_ptr<llvm::Module> module;
     std::string fnName;
-    AssumptionList allAssumptions;
-    CUModuleMap cumodules;
+    // Only kept when a compile server is configured
+    std::string bitcode;
+    std::string bitcodeDigest;
+    AssumptionTable table;
+    // Published by compile threads; entries below numVariants are immutable
+    Variant variants[MaxVariants];
+    std::atomic<unsigned> numVariants{0};
+    std::mutex publishing;
+    std::vector<unsigned> intParams;
+    bool scannedParams = false;
+    // Grid dimensions seen to change between launches
+    int firstGrid[3] = {};
+    bool gridVaries[3] = {};
+    bool coarsenable = false;
+    bool scannedCoarsen = false;
+    // Caller hints, see pinParameter() and friends
+    std::vector<unsigned> pinnedParams;
+    bool pinnedDims[6] = {};
+    bool pinsResolved = true;
+    std::vector<unsigned> forbiddenParams;
+    // Watched parameters and the value each had on the previous launch
+    std::vector<unsigned> watchedParams;
+    std::vector<long long> lastWatched;
+    std::vector<AssumptionTable::Mask> requested;
+    // The last background compile's mask, retained until the launch thread
+    // sees it finish; only the compile thread writes the two flags
+    AssumptionTable::Mask asyncMask;
+    bool asyncPending = false;
+    std::atomic<bool> asyncDone{false};
+    std::atomic<bool> asyncPublished{false};
+    unsigned maxVariants = MaxVariants;
+    // Set once a compile fails (a bad library, say); no more variants are tried
+    std::atomic<bool> compileFailed{false};
+    // Set when not even the first-launch compile succeeded
+    bool unlaunchable = false;
+    // Device bitcode libraries linked into every variant, see addLibrary()
+    std::vector<std::shared_ptr<const llvm::Module>> libraryModules;
+    std::vector<const llvm::Module*> libraries;
+    // This kernel's Trace track, once registered
+    int traceTrack = -1;
 
   public:
     KernelFunction(void* bitcode, size_t len);
@@ -31,21 +94,109 @@ class KernelFunction {
     CUresult launchKernel(int gridX, int gridY, int gridZ,
                           int blockX, int blockY, int blockZ,
                           int smem, CUstream stream, void** params);
-    std::string getKernelName();
+    const std::string& getKernelName();
+    /*
+     * Whether the bitcode parsed and defines the kernel
+     */
+    bool hasKernel();
+    /*
+     * False once no module could be compiled for the kernel. launchKernel
+     * then fails without launching; callers with the original kernel at
+     * hand should launch that instead.
+     */
+    bool isLaunchable() const {return !unlaunchable;}
+    /*
+     * Specialization hints. Give them before launching; they shape the
+     * first-launch compile as well as every background compile after it.
+     */
+    // A 32-bit integer parameter keeps its first-launch value for the life of the job
+    void pinParameter(unsigned index);
+    // A launch dimension keeps its first-launch value for the life of the job
+    void pinDimension(GeometryAssumption::Dim dim);
+    // Propose a 32-bit integer parameter's value once it repeats on
+    // consecutive launches; otherwise parameter values aren't proposed
+    void watchParameter(unsigned index);
+    // Never specialize on this parameter
+    void forbidParameter(unsigned index);
+    // Queue a variant for these assumptions. Requests are compiled in the
+    // background in the order given, one at a time from the first launch
+    // on, ahead of variants chosen from launch history. Requests naming a
+    // forbidden or non-int32 parameter are ignored.
+    void requestVariant(const AssumptionList& assumptions);
+    // Stop compiling new variants once n exist (at most MaxVariants)
+    void setMaxVariants(unsigned n);
+
+    /*
+     * Link the functions the kernel calls from a device bitcode library
+     * (libdevice, shared helpers) into every variant. Register libraries
+     * before the first launch; returns false if the bitcode doesn't parse.
+     * Variants with libraries are always compiled in-process.
+     */
+    bool addLibrary(const void* bitcode, size_t len);
+    bool addLibraryFile(const std::string& path);
+    /*
+     * Parse a library once and share it between KernelFunctions, rather
+     * than have each parse its own copy; nullptr if it doesn't parse
+     */
+    static std::shared_ptr<const llvm::Module> parseLibrary(const void* bitcode, size_t len,
+                                                            const std::string& name = "<library>");
+    static std::shared_ptr<const llvm::Module> parseLibraryFile(const std::string& path);
+    void addLibrary(std::shared_ptr<const llvm::Module> library);
+    const std::vector<const llvm::Module*>& getLibraries() const {return libraries;}
+
+    /*
+     * Specialize kernelName in module for assumptions and generate PTX for
+     * arch (the module's own target CPU when empty). Shared by in-process
+     * compiles and compile_server. *coarsened is set to the coarsening
+     * factor actually applied, 1 if the kernel was left uncoarsened.
+     */
+    static std::string* compilePTX(const AssumptionList& assumptions, const llvm::Module* module,
+                                   const std::string& kernelName, const std::string& arch,
+                                   CompileProfile* prof,
+                                   const std::vector<const llvm::Module*>& libraries = std::vector<const llvm::Module*>(),
+                                   int* coarsened = nullptr);
+    /*
+     * Link libraries into M, only the symbols M references when onlyNeeded
+     */
+    static bool linkLibraries(llvm::Module& M, const std::vector<const llvm::Module*>& libraries, bool onlyNeeded);
+
+    /*
+     * Generate PTX for M at the given codegen opt level. With prof, each
+     * codegen pass is recorded as its own stage.
+     */
+    static std::string* moduleToPTX(llvm::Module &M, const std::string& arch,
+                                    llvm::CodeGenOpt::Level OLvl = llvm::CodeGenOpt::Default,
+                                    CompileProfile* prof = nullptr);
+
+    static bool isCompiling() {return compiling;}
+    unsigned getVariantCount() const {return numVariants;}
     ~KernelFunction();
 
   private:
-    static std::string* moduleToPTX(llvm::Module &M);
     static CUmodule loadCUmodule(const std::string& ptx);
-    static CUmodule compileModule(const AssumptionList&, const llvm::Module*);
+    static std::string deviceArch();
+    static int smCount();
+    CUmodule compileModule(const AssumptionList&, int* coarsened);
+    static void simplifyModule(llvm::Module& M, CompileProfile* prof);
+    static void stripModule(llvm::Module& M, const llvm::Module& orig, const std::string& kernelName);
     static void LLVMInit();
     static void CUDAInit();
     static void *compileModuleAsync_thread(void *);
-    void compileModuleAsync(AssumptionList);
+    void compileModuleAsync(const AssumptionTable::Mask&);
+    const Variant* publishVariant(const AssumptionList&, const AssumptionTable::Mask&, CUmodule, int coarsen);
     void proposeAssumptions(int gridX, int gridY, int gridZ,
                             int blockX, int blockY, int blockZ,
                             int smem, void** params);
     void compileLikelyModule();
-    bool hasAssumption(const Assumption& a);
-    bool hasCompiledAssumptions(const AssumptionList&) const;
+    const std::vector<unsigned>& scalarIntParams();
+    bool isCoarsenable();
+    uint16_t getTraceTrack();
+    static std::string summarize(const AssumptionList&);
+    bool isForbidden(unsigned param) const;
+    void resolvePins(int gridX, int gridY, int gridZ,
+                     int blockX, int blockY, int blockZ, void** params);
+    bool hasCompiledAssumptions(const AssumptionTable::Mask&) const;
+    void dropVaryingGrid(AssumptionTable::Mask&) const;
 };
+
+#endif
@@ -0,0 +1,180 @@
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include "Trace.h"
+
+#include <chrono>
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+struct Ring {
+  Trace::Event* events = nullptr;
+  uint64_t capacity = 0;
+  std::atomic<uint64_t> head{0};
+  std::string path;
+  std::chrono::steady_clock::time_point epoch;
+};
+
+std::mutex tracksLock;
+std::vector<std::string> trackNames;
+
+void dumpAtExit() {
+    Trace::dump();
+}
+
+Ring& ring() {
+    static Ring* r = [] {
+      Ring* r = new Ring;
+      const char* path = getenv("GPUJIT_TRACE");
+      if(!path || !*path)
+        return r;
+      const char* events = getenv("GPUJIT_TRACE_EVENTS");
+      long capacity = events ? atol(events) : 0;
+      r->capacity = capacity > 0 ? capacity : 1 << 16;
+      r->events = new Trace::Event[r->capacity]();
+      r->path = path;
+      r->epoch = std::chrono::steady_clock::now();
+      atexit(dumpAtExit);
+      return r;
+    }();
+    return *r;
+}
+
+void writeString(raw_ostream& os, const char* s) {
+    os << '"';
+    for(; *s; ++s) {
+      if(*s == '"' || *s == '\\')
+        os << '\\';
+      if((unsigned char)*s >= 0x20)
+        os << *s;
+    }
+    os << '"';
+}
+
+}
+
+bool Trace::enabled() {
+    return ring().events != nullptr;
+}
+
+uint16_t Trace::track(const std::string& name) {
+    std::lock_guard<std::mutex> guard(tracksLock);
+    trackNames.push_back(name);
+    return trackNames.size() - 1;
+}
+
+uint16_t Trace::workerTrack() {
+    static uint16_t worker = track("background compile");
+    return worker;
+}
+
+int64_t Trace::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - ring().epoch).count();
+}
+
+void Trace::instant(uint16_t track, const char* name, int variant, const char* detail) {
+    record(track, name, 'i', now(), 0, variant, detail);
+}
+
+void Trace::complete(uint16_t track, const char* name, int64_t start, int variant, const char* detail) {
+    record(track, name, 'X', start, now() - start, variant, detail);
+}
+
+void Trace::record(uint16_t track, const char* name, char phase, int64_t ts, int64_t dur, int variant, const char* detail) {
+    Ring& r = ring();
+    if(!r.events)
+      return;
+    // Claim the next slot; a zero seq marks it as being written
+    uint64_t i = r.head.fetch_add(1, std::memory_order_relaxed);
+    Event& e = r.events[i % r.capacity];
+    e.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    e.name = name;
+    e.phase = phase;
+    e.track = track;
+    e.variant = variant;
+    e.ts = ts;
+    e.dur = dur;
+    if(detail) {
+      strncpy(e.detail, detail, sizeof(e.detail) - 1);
+      e.detail[sizeof(e.detail) - 1] = '\0';
+    } else {
+      e.detail[0] = '\0';
+    }
+    e.seq.store(i + 1, std::memory_order_release);
+}
+
+bool Trace::dump(const std::string& path) {
+    Ring& r = ring();
+    if(!r.events)
+      return false;
+    std::string out = path.empty() ? r.path : path;
+    std::error_code EC;
+    raw_fd_ostream os(out, EC, sys::fs::F_Text);
+    if(EC) {
+      errs() << "Trace: cannot write " << out << ": " << EC.message() << "\n";
+      return false;
+    }
+    int pid = getpid();
+    os << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+    bool first = true;
+    {
+      std::lock_guard<std::mutex> guard(tracksLock);
+      for(unsigned t=0; t<trackNames.size(); ++t) {
+        os << (first ? "\n" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << pid
+           << ", \"tid\": " << t << ", \"args\": {\"name\": ";
+        writeString(os, trackNames[t].c_str());
+        os << "}}";
+        first = false;
+      }
+    }
+
+    uint64_t end = r.head.load(std::memory_order_acquire);
+    uint64_t begin = end > r.capacity ? end - r.capacity : 0;
+    for(uint64_t i=begin; i<end; ++i) {
+      Event& slot = r.events[i % r.capacity];
+      if(slot.seq.load(std::memory_order_acquire) != i + 1)
+        continue;
+      const char* name = slot.name;
+      char phase = slot.phase;
+      uint16_t track = slot.track;
+      int variant = slot.variant;
+      int64_t ts = slot.ts, dur = slot.dur;
+      char detail[sizeof(slot.detail)];
+      memcpy(detail, slot.detail, sizeof(detail));
+      detail[sizeof(detail) - 1] = '\0';
+      // Skip the event if a writer lapped us while we copied it
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if(slot.seq.load(std::memory_order_relaxed) != i + 1)
+        continue;
+
+      os << (first ? "\n" : ",\n") << "{\"name\": ";
+      writeString(os, name);
+      os << ", \"ph\": \"" << phase << "\", \"pid\": " << pid << ", \"tid\": " << track
+         << ", \"ts\": " << format("%.3f", ts / 1000.0);
+      if(phase == 'X')
+        os << ", \"dur\": " << format("%.3f", dur / 1000.0);
+      else
+        os << ", \"s\": \"t\"";
+      os << ", \"args\": {";
+      if(variant >= 0)
+        os << "\"variant\": " << variant << (detail[0] ? ", " : "");
+      if(detail[0]) {
+        os << "\"detail\": ";
+        writeString(os, detail);
+      }
+      os << "}}";
+      first = false;
+    }
+    os << "\n]}\n";
+    if(end > r.capacity)
+      errs() << "Trace: ring buffer wrapped, kept the last " << r.capacity << " of " << end << " events\n";
+    return true;
+}
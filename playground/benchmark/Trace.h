@@ -0,0 +1,62 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+/*
+ * Timeline of JIT activity, enabled by setting GPUJIT_TRACE to an output
+ * path. Events go into a fixed ring buffer (GPUJIT_TRACE_EVENTS entries,
+ * oldest overwritten first), so recording never allocates or blocks, and
+ * are written as Chrome trace-event JSON by dump() and at exit. Load the
+ * file in chrome://tracing or Perfetto.
+ *
+ * Each kernel gets its own track, holding its launches and any compile
+ * run on the launching thread. Background compiles, one at a time, share
+ * a single worker track.
+ */
+class Trace {
+  public:
+    /*
+     * One recorded event. seq is the event's position in the stream plus
+     * one, published last so readers can skip slots being overwritten.
+     */
+    struct Event {
+      std::atomic<uint64_t> seq;
+      const char* name;
+      char phase;
+      uint16_t track;
+      int32_t variant;
+      int64_t ts;
+      int64_t dur;
+      char detail[80];
+    };
+
+    static bool enabled();
+    /*
+     * Register a named track; call once per kernel, not per event
+     */
+    static uint16_t track(const std::string& name);
+    /*
+     * The background compile track
+     */
+    static uint16_t workerTrack();
+    // Nanoseconds on the trace clock
+    static int64_t now();
+    /*
+     * Record a point event, or a span that began at start. name must be a
+     * string literal; detail is copied and truncated, variant -1 is omitted.
+     */
+    static void instant(uint16_t track, const char* name, int variant = -1, const char* detail = nullptr);
+    static void complete(uint16_t track, const char* name, int64_t start, int variant = -1, const char* detail = nullptr);
+    /*
+     * Write the buffered events to path, or to $GPUJIT_TRACE when empty
+     */
+    static bool dump(const std::string& path = "");
+
+  private:
+    static void record(uint16_t track, const char* name, char phase, int64_t ts, int64_t dur, int variant, const char* detail);
+};
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ * Checks that AssumptionTable keeps specializing after more than Capacity
+ * distinct keys: entries that stopped holding are recycled, while retained,
+ * pinned and still-holding ones keep their index until released. No GPU or
+ * kernel needed.
+ *
+ * Usage: assumption_table_test   (exit status 0 on success)
+ */
+#include "llvm/Support/raw_ostream.h"
+
+#include "AssumptionTable.h"
+
+using namespace llvm;
+
+static int failures = 0;
+
+static void expect(bool ok, const char* what) {
+    if(!ok) {
+      errs() << "assumption_table_test: FAILED: " << what << "\n";
+      failures++;
+    }
+}
+
+/*
+ * Every interned key can still be found at its own index
+ */
+static bool consistent(const AssumptionTable& table) {
+    for(unsigned i=0; i<table.size(); ++i) {
+      if(table.find(table[i].key()) != (int)i)
+        return false;
+    }
+    return true;
+}
+
+/*
+ * One launch with problem size n: propose its value, then record outcomes
+ */
+static int launch(AssumptionTable& table, int n) {
+    int i = table.intern(ParamAssumption::keyFor(0, n));
+    void* params[] = {&n};
+    table.update(128, 1, 1, 512, 1, 1, 0, params);
+    return i;
+}
+
+int main() {
+    const unsigned Capacity = AssumptionTable::Capacity;
+    AssumptionTable table;
+
+    // Entries that must survive: one holding on every launch, one pinned
+    // and one retained by a variant, neither of which holds again
+    AssumptionKey steady = GeometryAssumption::keyFor(GeometryAssumption::BlockX, 512);
+    AssumptionKey pinnedKey = ParamAssumption::keyFor(0, -3);
+    AssumptionKey retainedKey = ParamAssumption::keyFor(0, -1);
+    int steadyIndex = table.intern(steady);
+    int pinnedIndex = table.intern(pinnedKey);
+    int retainedIndex = table.intern(retainedKey);
+    table.pin(pinnedIndex);
+    AssumptionTable::Mask variant;
+    variant.set(retainedIndex);
+    table.retain(variant);
+
+    // A new problem size every launch, well past Capacity
+    bool interned = true;
+    for(int n=0; n<(int)Capacity * 8; ++n) {
+      int i = launch(table, n);
+      if(i < 0 || table.find(ParamAssumption::keyFor(0, n)) != i)
+        interned = false;
+    }
+    expect(interned, "every new key is interned after the table fills");
+    expect(table.size() == Capacity, "the table filled before recycling");
+    expect(consistent(table), "probe chains survive recycling");
+    expect(table.find(steady) == steadyIndex, "an assumption that keeps holding is kept");
+    expect(table.find(pinnedKey) == pinnedIndex, "a pinned assumption is kept");
+    expect(table.find(retainedKey) == retainedIndex, "a retained assumption is kept");
+    expect(table.likely().test(steadyIndex), "the steady assumption is still likely");
+
+    // With every entry retained there is nothing to recycle
+    AssumptionTable::Mask all;
+    all.set();
+    table.retain(all);
+    expect(table.intern(ParamAssumption::keyFor(0, -2)) < 0, "a fully retained table refuses new keys");
+    expect(consistent(table), "a refused key leaves the table intact");
+
+    // Masks overlap, so an entry stays retained until its last holder lets go
+    AssumptionTable shared;
+    int kept = shared.intern(ParamAssumption::keyFor(0, -1));
+    AssumptionTable::Mask first, second;
+    first.set(kept);
+    second.set(kept);
+    shared.retain(first);
+    shared.retain(second);
+    shared.release(first);
+    expect(shared.isRetained(kept), "an entry still in a retained mask stays retained");
+    shared.release(second);
+    expect(!shared.isRetained(kept), "releasing the last mask frees the entry");
+    for(int n=0; n<(int)Capacity * 8; ++n)
+      launch(shared, n);
+    expect(shared.find(ParamAssumption::keyFor(0, -1)) < 0, "a released entry is recycled");
+    expect(consistent(shared), "probe chains survive recycling a released entry");
+
+    if(failures)
+      return 1;
+    errs() << "assumption_table_test: OK\n";
+    return 0;
+}
@@ -0,0 +1,235 @@
+/*
+ * IR-level checks of Assumption::apply and CoarsenAssumption::canCoarsen:
+ * each test parses a small kernel, applies an assumption, and inspects
+ * what's left. No GPU needed.
+ *
+ * Usage: assumption_test   (exit status 0 on success)
+ */
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Assumption.h"
+
+using namespace llvm;
+using namespace llvm::PatternMatch;
+
+static int failures = 0;
+
+static void expect(bool ok, const char* what) {
+    if(!ok) {
+      errs() << "assumption_test: FAILED: " << what << "\n";
+      failures++;
+    }
+}
+
+static LLVMContext Context;
+
+static const char* sregs =
+    "target triple = \"nvptx64-nvidia-cuda\"\n"
+    "declare i32 @llvm.nvvm.read.ptx.sreg.ctaid.x()\n"
+    "declare i32 @llvm.nvvm.read.ptx.sreg.nctaid.x()\n"
+    "declare i32 @llvm.nvvm.read.ptx.sreg.ntid.x()\n"
+    "declare i32 @llvm.nvvm.read.ptx.sreg.tid.x()\n";
+
+static std::unique_ptr<Module> parse(const std::string& body) {
+    SMDiagnostic error;
+    std::unique_ptr<Module> M = parseAssemblyString(std::string(sregs) + body, error, Context);
+    if(!M)
+      error.print("assumption_test", errs());
+    return M;
+}
+
+/*
+ * Whether the branch in K's entry block still tests a comparison
+ */
+static bool guarded(Function* K) {
+    auto br = dyn_cast<BranchInst>(K->getEntryBlock().getTerminator());
+    return br && br->isConditional() && isa<ICmpInst>(br->getCondition());
+}
+
+/*
+ * if(idx < n) out[idx] = 1, with the index spelled two common ways
+ */
+static const char* guardKernels =
+    // blockDim.x*blockIdx.x + threadIdx.x, widened to 64 bits
+    "define void @wide(i32* %out, i32 %n) {\n"
+    "entry:\n"
+    "  %ctaid = call i32 @llvm.nvvm.read.ptx.sreg.ctaid.x()\n"
+    "  %ntid = call i32 @llvm.nvvm.read.ptx.sreg.ntid.x()\n"
+    "  %tid = call i32 @llvm.nvvm.read.ptx.sreg.tid.x()\n"
+    "  %scaled = mul i32 %ntid, %ctaid\n"
+    "  %idx = add i32 %scaled, %tid\n"
+    "  %wide = sext i32 %idx to i64\n"
+    "  %wn = sext i32 %n to i64\n"
+    "  %in = icmp slt i64 %wide, %wn\n"
+    "  br i1 %in, label %body, label %exit\n"
+    "body:\n"
+    "  %p = getelementptr i32, i32* %out, i64 %wide\n"
+    "  store i32 1, i32* %p\n"
+    "  br label %exit\n"
+    "exit:\n"
+    "  ret void\n"
+    "}\n"
+    // threadIdx.x + (blockIdx.x << 9), compared the other way round
+    "define void @shifted(i32* %out, i32 %n) {\n"
+    "entry:\n"
+    "  %ctaid = call i32 @llvm.nvvm.read.ptx.sreg.ctaid.x()\n"
+    "  %tid = call i32 @llvm.nvvm.read.ptx.sreg.tid.x()\n"
+    "  %scaled = shl i32 %ctaid, 9\n"
+    "  %idx = add i32 %tid, %scaled\n"
+    "  %in = icmp sgt i32 %n, %idx\n"
+    "  br i1 %in, label %body, label %exit\n"
+    "body:\n"
+    "  %p = getelementptr i32, i32* %out, i32 %idx\n"
+    "  store i32 1, i32* %p\n"
+    "  br label %exit\n"
+    "exit:\n"
+    "  ret void\n"
+    "}\n";
+
+static void testGridCoverage() {
+    const char* kernels[] = {"wide", "shifted"};
+    for(int k=0; k<2; ++k) {
+      std::unique_ptr<Module> M = parse(guardKernels);
+      if(!M) {
+        failures++;
+        return;
+      }
+      Function* K = M->getFunction(kernels[k]);
+      GridCoverageAssumption(0, 512, 1, GridCoverageAssumption::Covers).apply(K);
+      expect(guarded(K), "Covers leaves the idx < n guard");
+      GridCoverageAssumption(0, 512, 1, GridCoverageAssumption::Within).apply(K);
+      expect(!guarded(K), "Within folds the idx < n guard");
+    }
+
+    // A different block size proves nothing about this index
+    std::unique_ptr<Module> M = parse(guardKernels);
+    Function* K = M->getFunction("shifted");
+    GridCoverageAssumption(0, 256, 1, GridCoverageAssumption::Within).apply(K);
+    expect(guarded(K), "Within for another block size leaves the guard");
+}
+
+/*
+ * out[blockIdx.x] = gridDim.x, one thread per block
+ */
+static const char* blockKernel =
+    "define void @blocks(i32* %out) {\n"
+    "entry:\n"
+    "  %ctaid = call i32 @llvm.nvvm.read.ptx.sreg.ctaid.x()\n"
+    "  %nctaid = call i32 @llvm.nvvm.read.ptx.sreg.nctaid.x()\n"
+    "  %p = getelementptr i32, i32* %out, i32 %ctaid\n"
+    "  store i32 %nctaid, i32* %p\n"
+    "  ret void\n"
+    "}\n";
+
+/*
+ * The first call in K to the named intrinsic
+ */
+static Value* firstCall(Function* K, StringRef name) {
+    for(auto I=K->getEntryBlock().begin(),e=K->getEntryBlock().end(); I!=e; ++I) {
+      auto call = dyn_cast<CallInst>(&*I);
+      if(call && call->getCalledFunction() && call->getCalledFunction()->getName() == name)
+        return call;
+    }
+    return nullptr;
+}
+
+static void testCoarsen() {
+    const int factor = 4;
+    std::unique_ptr<Module> M = parse(blockKernel);
+    if(!M) {
+      failures++;
+      return;
+    }
+    Function* K = M->getFunction("blocks");
+    expect(CoarsenAssumption::canCoarsen(K), "a kernel without shared state can be coarsened");
+    expect(CoarsenAssumption(factor).apply(K), "coarsening a safe kernel succeeds");
+    expect(!M->getFunction("blocks.coarsened"), "the coarsened body is inlined and removed");
+
+    Value* ctaid = firstCall(K, "llvm.nvvm.read.ptx.sreg.ctaid.x");
+    Value* nctaid = firstCall(K, "llvm.nvvm.read.ptx.sreg.nctaid.x");
+    expect(ctaid && nctaid, "the kernel still reads blockIdx.x and gridDim.x");
+    if(!ctaid || !nctaid)
+      return;
+
+    // Each logical block b + i*gridDim.x stores the logical grid size
+    bool seen[factor] = {false};
+    int stores = 0;
+    for(auto I=K->getEntryBlock().begin(),e=K->getEntryBlock().end(); I!=e; ++I) {
+      auto store = dyn_cast<StoreInst>(&*I);
+      if(!store)
+        continue;
+      stores++;
+      expect(match(store->getValueOperand(), m_Mul(m_Specific(nctaid), m_SpecificInt(factor))),
+             "gridDim.x is rewritten to gridDim.x * factor");
+      auto gep = dyn_cast<GetElementPtrInst>(store->getPointerOperand());
+      if(!gep)
+        continue;
+      Value* index = gep->getOperand(1);
+      if(index == ctaid)
+        seen[0] = true;
+      for(int i=1; i<factor; ++i) {
+        if(match(index, m_Add(m_Specific(ctaid), m_Mul(m_Specific(nctaid), m_SpecificInt(i)))))
+          seen[i] = true;
+      }
+    }
+    expect(stores == factor, "the body runs once per logical block");
+    for(int i=0; i<factor; ++i)
+      expect(seen[i], "blockIdx.x is rewritten to blockIdx.x + i * gridDim.x");
+}
+
+/*
+ * Kernels whose threads can observe each other, so running them in
+ * sequence on one thread would change what they compute
+ */
+static const char* unsafeKernels =
+    "declare void @llvm.nvvm.barrier0()\n"
+    "@tile = internal addrspace(3) global [32 x i32] undef\n"
+    "define void @barrier(i32* %out) {\n"
+    "entry:\n"
+    "  store i32 1, i32* %out\n"
+    "  call void @llvm.nvvm.barrier0()\n"
+    "  ret void\n"
+    "}\n"
+    "define void @atomic(i32* %out) {\n"
+    "entry:\n"
+    "  %old = atomicrmw add i32* %out, i32 1 seq_cst\n"
+    "  ret void\n"
+    "}\n"
+    "define void @shared(i32* %out) {\n"
+    "entry:\n"
+    "  %tid = call i32 @llvm.nvvm.read.ptx.sreg.tid.x()\n"
+    "  %p = getelementptr [32 x i32], [32 x i32] addrspace(3)* @tile, i32 0, i32 %tid\n"
+    "  store i32 1, i32 addrspace(3)* %p\n"
+    "  ret void\n"
+    "}\n";
+
+static void testCoarsenRejects() {
+    std::unique_ptr<Module> M = parse(unsafeKernels);
+    if(!M) {
+      failures++;
+      return;
+    }
+    const char* kernels[] = {"barrier", "atomic", "shared"};
+    for(int k=0; k<3; ++k) {
+      Function* K = M->getFunction(kernels[k]);
+      expect(!CoarsenAssumption::canCoarsen(K), kernels[k]);
+      expect(!CoarsenAssumption(2).apply(K) && !M->getFunction(std::string(kernels[k]) + ".coarsened"),
+             "an unsafe kernel is left unchanged");
+    }
+}
+
+int main() {
+    testGridCoverage();
+    testCoarsen();
+    testCoarsenRejects();
+    if(failures)
+      return 1;
+    errs() << "assumption_test: OK\n";
+    return 0;
+}
@@ -0,0 +1,273 @@
+/*
+ * Node-local compile server shared by every JIT process on the node.
+ *
+ * Clients (KernelFunction with GPUJIT_COMPILE_SOCKET set) send
+ * (bitcode digest, kernel, assumption keys, arch) and get PTX back. Bitcode
+ * and generated PTX are cached in memory up to a byte budget, least
+ * recently used first out, and a request matching one already being
+ * compiled waits for that result instead of compiling again. Distinct requests compile in parallel, each parsing
+ * the bitcode into an LLVMContext of its own.
+ *
+ * Bitcode is identified by its SHA-1, checked when it's uploaded, and the
+ * socket is only accessible to the user running the server.
+ *
+ * Usage: compile_server [socket path] [cache MB]
+ *        (defaults: $GPUJIT_COMPILE_SOCKET, 1024 MB)
+ */
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+#include "CompileProtocol.h"
+#include "CompileProfile.h"
+#include "KernelFunction.h"
+
+using namespace llvm;
+
+namespace {
+
+/*
+ * One cached or in-flight compile
+ */
+struct Artifact {
+  bool done = false;
+  std::shared_ptr<std::string> ptx;
+  int coarsened = 1;
+  uint64_t lastUse = 0;
+};
+
+struct CachedBitcode {
+  std::shared_ptr<const std::string> bytes;
+  uint64_t lastUse;
+};
+
+// Guards the caches below and every Artifact
+std::mutex stateLock;
+std::condition_variable compiled;
+std::map<std::string, CachedBitcode> bitcodes;
+std::map<std::string, std::shared_ptr<Artifact>> artifacts;
+unsigned long hits = 0, misses = 0;
+// Bytes of bitcode and PTX cached, and the most allowed
+uint64_t cachedBytes = 0;
+uint64_t cacheBudget = 1024ULL << 20;
+// Ticks on every use, to order entries for eviction
+uint64_t useClock = 0;
+
+/*
+ * Drop least recently used bitcode and finished artifacts until the cache
+ * fits its budget. Compiles and waiters hold their own references, so
+ * nothing in use goes away. Call with stateLock held.
+ */
+void evict() {
+  while(cachedBytes > cacheBudget) {
+    auto oldBitcode = bitcodes.end();
+    auto oldArtifact = artifacts.end();
+    uint64_t oldest = UINT64_MAX;
+    for(auto b=bitcodes.begin(),e=bitcodes.end(); b!=e; ++b) {
+      if(b->second.lastUse < oldest) {
+        oldest = b->second.lastUse;
+        oldBitcode = b;
+      }
+    }
+    for(auto a=artifacts.begin(),e=artifacts.end(); a!=e; ++a) {
+      if(a->second->done && a->second->lastUse < oldest) {
+        oldest = a->second->lastUse;
+        oldArtifact = a;
+      }
+    }
+    if(oldArtifact != artifacts.end()) {
+      cachedBytes -= oldArtifact->second->ptx->size();
+      artifacts.erase(oldArtifact);
+    } else if(oldBitcode != bitcodes.end()) {
+      cachedBytes -= oldBitcode->second.bytes->size();
+      bitcodes.erase(oldBitcode);
+    } else {
+      break;
+    }
+  }
+}
+
+std::string artifactKey(const CompileProtocol::Request& req) {
+  std::string key;
+  raw_string_ostream os(key);
+  os << req.bitcodeDigest << "/" << req.kernel << "/" << req.arch;
+  for(auto k=req.keys.begin(),e=req.keys.end(); k!=e; ++k)
+    os << "/" << (int)k->kind << "," << (int)k->dim << "," << k->aux << "," << k->value << "," << k->value2;
+  return os.str();
+}
+
+/*
+ * Cache the bitcode in req; false if it doesn't match its digest or
+ * couldn't fit in the cache
+ */
+bool addBitcode(const CompileProtocol::Request& req) {
+  if(CompileProtocol::digest(req.bitcode.data(), req.bitcode.size()) != req.bitcodeDigest)
+    return false;
+  std::lock_guard<std::mutex> guard(stateLock);
+  if(req.bitcode.size() > cacheBudget)
+    return false;
+  CachedBitcode& cached = bitcodes[req.bitcodeDigest];
+  if(cached.bytes)
+    cachedBytes -= cached.bytes->size();
+  cached.bytes = std::make_shared<const std::string>(req.bitcode);
+  cached.lastUse = ++useClock;
+  cachedBytes += req.bitcode.size();
+  evict();
+  return true;
+}
+
+/*
+ * Parse bitcode and specialize it as req asks. LLVM state isn't shared
+ * between threads, so each compile gets its own context.
+ */
+std::string* compile(const CompileProtocol::Request& req, const std::string& bitcode, int& coarsened) {
+  LLVMContext Context;
+  auto buffer = MemoryBuffer::getMemBuffer(StringRef(bitcode.data(), bitcode.size()), "<client>", false);
+  SMDiagnostic error;
+  std::unique_ptr<Module> M = parseIR(MemoryBufferRef(*buffer), error, Context);
+  if(!M) {
+    error.print("compile_server", errs());
+    return nullptr;
+  }
+
+  AssumptionList assumptions;
+  for(auto k=req.keys.begin(),e=req.keys.end(); k!=e; ++k) {
+    if(auto assumption = Assumption::fromKey(*k))
+      assumptions.push_back(assumption);
+  }
+  std::unique_ptr<CompileProfile> prof;
+  if(CompileProfile::enabled())
+    prof.reset(new CompileProfile(req.kernel, assumptions));
+  std::string* ptx = KernelFunction::compilePTX(assumptions, M.get(), req.kernel, req.arch, prof.get(),
+                                                std::vector<const Module*>(), &coarsened);
+  if(prof)
+    prof->finish();
+  return ptx;
+}
+
+CompileProtocol::Status serve(const CompileProtocol::Request& req, std::string& ptx, int& coarsened) {
+  std::string key = artifactKey(req);
+  std::unique_lock<std::mutex> state(stateLock);
+  auto bc = bitcodes.find(req.bitcodeDigest);
+  if(bc == bitcodes.end())
+    return CompileProtocol::NeedBitcode;
+  bc->second.lastUse = ++useClock;
+
+  auto found = artifacts.find(key);
+  if(found != artifacts.end()) {
+    // Cached, or being compiled for another client: wait for it
+    std::shared_ptr<Artifact> a = found->second;
+    compiled.wait(state, [&]{ return a->done; });
+    if(!a->ptx)
+      return CompileProtocol::Failed;
+    a->lastUse = ++useClock;
+    hits++;
+    ptx = *a->ptx;
+    coarsened = a->coarsened;
+    return CompileProtocol::OK;
+  }
+
+  std::shared_ptr<Artifact> a = std::make_shared<Artifact>();
+  artifacts[key] = a;
+  misses++;
+  std::shared_ptr<const std::string> bitcode = bc->second.bytes;
+  state.unlock();
+
+  int factor = 1;
+  std::string* result = compile(req, *bitcode, factor);
+
+  state.lock();
+  a->done = true;
+  if(result) {
+    a->ptx.reset(result);
+    a->coarsened = factor;
+    a->lastUse = ++useClock;
+    cachedBytes += result->size();
+    ptx = *result;
+    coarsened = factor;
+  } else {
+    // Let a later request try again
+    artifacts.erase(key);
+  }
+  compiled.notify_all();
+  evict();
+  errs() << "compile_server: " << req.kernel << " [" << req.keys.size() << " assumptions] "
+         << (result ? "compiled" : "failed") << " (" << hits << " hits, " << misses << " misses)\n";
+  return result ? CompileProtocol::OK : CompileProtocol::Failed;
+}
+
+void handleClient(int fd) {
+  CompileProtocol::Request req;
+  while(CompileProtocol::readRequest(fd, req)) {
+    std::string ptx;
+    int coarsened = 1;
+    CompileProtocol::Status status;
+    if(!req.bitcode.empty() && !addBitcode(req))
+      status = CompileProtocol::Failed;
+    else
+      status = serve(req, ptx, coarsened);
+    if(!CompileProtocol::writeResponse(fd, status, ptx, coarsened))
+      break;
+  }
+  close(fd);
+}
+
+}
+
+int main(int argc, char** argv) {
+  std::string path = argc > 1 ? argv[1] : CompileProtocol::socketPath();
+  if(path.empty()) {
+    fprintf(stderr, "Usage: %s <socket path> [cache MB]  (or set GPUJIT_COMPILE_SOCKET)\n", argv[0]);
+    return 1;
+  }
+  if(argc > 2)
+    cacheBudget = strtoull(argv[2], nullptr, 10) << 20;
+
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(path.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path.c_str());
+    return 1;
+  }
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path.c_str());
+  // Other users could otherwise plant PTX for everyone else's kernels
+  mode_t mask = umask(077);
+  bool bound = listener >= 0 && bind(listener, (sockaddr*)&addr, sizeof(addr)) == 0;
+  umask(mask);
+  if(!bound || listen(listener, 64) != 0) {
+    perror("compile_server");
+    return 1;
+  }
+  // Clients that hang up mid-response shouldn't take the server down
+  signal(SIGPIPE, SIG_IGN);
+  errs() << "compile_server: listening on " << path << "\n";
+
+  while(true) {
+    int fd = accept(listener, nullptr, nullptr);
+    if(fd < 0)
+      continue;
+    std::thread(handleClient, fd).detach();
+  }
+}
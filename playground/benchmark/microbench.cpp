@@ -0,0 +1,284 @@
+/*
+ * Microbenchmarks for the JIT's own overheads, one stage at a time:
+ * bitcode parsing, module cloning, each kind of Assumption::apply, PTX
+ * generation per opt level, and launchKernel under synthetic launch
+ * streams, timed and with heap allocations per launch counted on the
+ * launching thread. Link against util/cuda_stub so no GPU is needed and
+ * launches cost only the JIT's dispatch and bookkeeping.
+ *
+ * Results go to stdout as one JSON object, so runs can be compared across
+ * commits; progress and JIT logging go to stderr.
+ *
+ * Device bitcode libraries given after the label are linked into the
+ * kernel three ways (not at all, whole, and only what the kernel needs,
+ * internalized and stripped) to compare compile time and PTX size.
+ *
+ * Usage: microbench [iterations] [label] [library.bc...]
+ */
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "KernelFunction.h"
+
+using namespace llvm;
+
+extern char _binary_kernel_bc_start;
+extern char _binary_kernel_bc_end;
+
+static const char* kernel = "_Z7Kernel2PbS_S_S_i";
+
+/*
+ * Per-iteration timings of one benchmark
+ */
+struct Result {
+    std::string name;
+    std::vector<double> ns;
+    unsigned variants = 0;
+    size_t ptxBytes = 0;
+    double allocationsPerLaunch = -1;
+};
+
+static std::vector<Result> results;
+
+// Heap allocations by this thread while counting is set
+static thread_local bool counting = false;
+static thread_local unsigned long allocations = 0;
+
+void* operator new(size_t size) {
+    if(counting)
+      allocations++;
+    void* p = malloc(size ? size : 1);
+    if(!p)
+      abort();
+    return p;
+}
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+void operator delete(void* p) noexcept {
+    free(p);
+}
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+static double elapsed(const std::function<void()>& body) {
+    auto start = std::chrono::steady_clock::now();
+    body();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+static Result& bench(const std::string& name) {
+    errs() << "microbench: " << name << "\n";
+    results.push_back(Result());
+    results.back().name = name;
+    return results.back();
+}
+
+static void waitForCompiles() {
+    while(KernelFunction::isCompiling())
+      usleep(1000);
+}
+
+/*
+ * Launch the kernel n times, with geometry and problem size chosen by next
+ * for each launch; returns ns per launch
+ */
+static double launchStream(KernelFunction& kf, long n, const std::function<void(long, int&, int&)>& next) {
+    void* mask = nullptr;
+    int nodes = 0, grid = 0;
+    void* params[] = {&mask, &mask, &mask, &mask, &nodes};
+    double ns = elapsed([&]{
+      for(long i=0; i<n; ++i) {
+        next(i, grid, nodes);
+        kf.launchKernel(grid, 1, 1, 512, 1, 1, 0, 0, params);
+      }
+    });
+    return ns / n;
+}
+
+static void printJSONString(const std::string& s) {
+    putchar('"');
+    for(auto c=s.begin(),e=s.end(); c!=e; ++c) {
+      if(*c == '"' || *c == '\\')
+        putchar('\\');
+      putchar(*c);
+    }
+    putchar('"');
+}
+
+static void printResults(const std::string& label, long iterations) {
+    printf("{\n  \"label\": ");
+    printJSONString(label);
+    printf(",\n  \"iterations\": %ld,\n  \"benchmarks\": [", iterations);
+    for(auto r=results.begin(),e=results.end(); r!=e; ++r) {
+      std::vector<double> ns = r->ns;
+      std::sort(ns.begin(), ns.end());
+      double total = 0;
+      for(auto t=ns.begin(),te=ns.end(); t!=te; ++t)
+        total += *t;
+      printf("%s\n    {\"name\": ", r == results.begin() ? "" : ",");
+      printJSONString(r->name);
+      printf(", \"samples\": %zu", ns.size());
+      if(!ns.empty())
+        printf(", \"mean_ns\": %.1f, \"median_ns\": %.1f, \"min_ns\": %.1f",
+               total / ns.size(), ns[ns.size() / 2], ns.front());
+      if(r->variants)
+        printf(", \"variants\": %u", r->variants);
+      if(r->ptxBytes)
+        printf(", \"ptx_bytes\": %zu", r->ptxBytes);
+      if(r->allocationsPerLaunch >= 0)
+        printf(", \"allocations_per_launch\": %.3f", r->allocationsPerLaunch);
+      printf("}");
+    }
+    printf("\n  ]\n}\n");
+}
+
+int main(int argc, char** argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 20;
+    std::string label = argc > 2 ? argv[2] : "";
+    char* bitcode = &_binary_kernel_bc_start;
+    size_t len = ((size_t)&_binary_kernel_bc_end)-((size_t)&_binary_kernel_bc_start);
+
+    // Parse the bitcode and find the kernel, as a process does on first launch
+    {
+      Result& r = bench("parse+getKernelName");
+      for(long i=0; i<iterations; ++i) {
+        r.ns.push_back(elapsed([&]{
+          KernelFunction kf(bitcode, len);
+          kf.getKernelName();
+        }));
+      }
+    }
+
+    KernelFunction kf(bitcode, len, kernel);
+    if(!kf.hasKernel()) {
+      errs() << "microbench: " << kernel << " missing from kernel.bc\n";
+      return 1;
+    }
+    const Module& M = kf.getModule();
+
+    {
+      Result& r = bench("CloneModule");
+      for(long i=0; i<iterations; ++i) {
+        std::unique_ptr<Module> clone;
+        r.ns.push_back(elapsed([&]{ clone = CloneModule(&M); }));
+      }
+    }
+
+    // One assumption of each kind, matching bfs's 128x512 launch over 65536 nodes
+    AssumptionList assumptions = {
+      std::make_shared<GeometryAssumption>(GeometryAssumption::BlockX, 512),
+      std::make_shared<GeometryAssumption>(GeometryAssumption::GridX, 128),
+      std::make_shared<GeometryRangeAssumption>(GeometryAssumption::GridX, 128, 255),
+      std::make_shared<GeometryMultipleAssumption>(GeometryAssumption::GridX, 32),
+      std::make_shared<GridCoverageAssumption>(0, 512, 4, GridCoverageAssumption::Within),
+      std::make_shared<ParamAssumption>(4, 65536),
+      std::make_shared<CoarsenAssumption>(4)
+    };
+    for(auto a=assumptions.begin(),e=assumptions.end(); a!=e; ++a) {
+      Result& r = bench("apply " + (*a)->describe());
+      for(long i=0; i<iterations; ++i) {
+        std::unique_ptr<Module> clone = CloneModule(&M);
+        Function* K = clone->getFunction(kernel);
+        r.ns.push_back(elapsed([&]{ (*a)->apply(K); }));
+      }
+    }
+
+    CodeGenOpt::Level levels[] = {CodeGenOpt::None, CodeGenOpt::Less, CodeGenOpt::Default, CodeGenOpt::Aggressive};
+    for(int l=0; l<4; ++l) {
+      Result& r = bench("moduleToPTX -O" + std::to_string(l));
+      for(long i=0; i<iterations; ++i) {
+        std::unique_ptr<Module> clone = CloneModule(&M);
+        r.ns.push_back(elapsed([&]{ delete KernelFunction::moduleToPTX(*clone, "", levels[l]); }));
+      }
+    }
+
+    // Clone, specialize, simplify and generate PTX, as a background compile does
+    {
+      Result& r = bench("compilePTX specialized");
+      for(long i=0; i<iterations; ++i)
+        r.ns.push_back(elapsed([&]{ delete KernelFunction::compilePTX(assumptions, &M, kernel, "", nullptr); }));
+    }
+
+    for(int i=3; i<argc; ++i) {
+      if(!kf.addLibraryFile(argv[i]))
+        return 1;
+    }
+    if(!kf.getLibraries().empty()) {
+      const std::vector<const Module*>& libs = kf.getLibraries();
+      for(int mode=0; mode<3; ++mode) {
+        const char* names[] = {"compilePTX no libraries", "compilePTX whole libraries", "compilePTX linked libraries"};
+        Result& r = bench(names[mode]);
+        for(long i=0; i<iterations; ++i) {
+          std::string* ptx = nullptr;
+          r.ns.push_back(elapsed([&]{
+            if(mode == 2) {
+              ptx = KernelFunction::compilePTX(AssumptionList(), &M, kernel, "", nullptr, libs);
+              return;
+            }
+            std::unique_ptr<Module> clone = CloneModule(&M);
+            if(mode == 0 || KernelFunction::linkLibraries(*clone, libs, false))
+              ptx = KernelFunction::moduleToPTX(*clone, "");
+          }));
+          r.ptxBytes = ptx ? ptx->size() : 0;
+          delete ptx;
+        }
+      }
+    }
+
+    // Launch streams. Each gets its own KernelFunction, is warmed up until
+    // background compiles settle, and then timed in batches of launches.
+    long launches = 10000;
+    struct Stream {
+      const char* name;
+      std::function<void(long, int&, int&)> next;
+    } streams[] = {
+      // The same launch every time, like one bfs level after another
+      {"steady", [](long i, int& grid, int& nodes) { grid = 128; nodes = 65536; }},
+      // Two inputs interleaved, each served by its own variant
+      {"alternating", [](long i, int& grid, int& nodes) {
+        grid = i % 2 ? 128 : 2048; nodes = grid * 512; }},
+      // A new problem size every launch, so the watched size never repeats
+      {"drifting", [](long i, int& grid, int& nodes) {
+        nodes = 65536 + (int)(i % 4096); grid = (nodes + 511) / 512; }}
+    };
+    for(auto s=std::begin(streams),e=std::end(streams); s!=e; ++s) {
+      Result& r = bench(std::string("launchKernel ") + s->name);
+      KernelFunction stream(bitcode, len, kernel);
+      stream.watchParameter(4);
+      for(int warm=0; warm<100; ++warm) {
+        launchStream(stream, 100, s->next);
+        waitForCompiles();
+      }
+      allocations = 0;
+      counting = true;
+      for(long i=0; i<iterations; ++i)
+        r.ns.push_back(launchStream(stream, launches, s->next));
+      counting = false;
+      if(iterations > 0)
+        r.allocationsPerLaunch = (double)allocations / (iterations * launches);
+      waitForCompiles();
+      r.variants = stream.getVariantCount();
+    }
+
+    printResults(label, iterations);
+    return 0;
+}
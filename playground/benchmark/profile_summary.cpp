@@ -0,0 +1,124 @@
+/*
+ * Ranks where KernelFunction compile time goes, from the passes.tsv written
+ * under GPUJIT_PROFILE_DIR (see CompileProfile.h).
+ *
+ * Usage: profile_summary <profile dir | passes.tsv>
+ */
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct StageTotals {
+    std::string stage;
+    long count = 0;
+    double ms = 0;
+    long delta = 0;
+    // Records with both counts; codegen stages have none
+    long deltas = 0;
+};
+
+/*
+ * Fold the values out of stage names, so "apply gridX==8" and
+ * "apply gridX==16" rank together as "apply gridX==N"
+ */
+static std::string stageKey(const std::string& stage) {
+    std::string key;
+    bool inNumber = false;
+    for(auto c=stage.begin(),e=stage.end(); c!=e; ++c) {
+      if(isdigit(*c)) {
+        if(!inNumber)
+          key += 'N';
+        inNumber = true;
+      } else {
+        key += *c;
+        inNumber = false;
+      }
+    }
+    return key;
+}
+
+static void printRanking(const char* title, std::map<std::string, StageTotals>& totals, double allMs) {
+    std::vector<StageTotals> ranked;
+    for(auto t=totals.begin(),e=totals.end(); t!=e; ++t)
+      ranked.push_back(t->second);
+    std::sort(ranked.begin(), ranked.end(), [](const StageTotals& a, const StageTotals& b) {
+      return a.ms > b.ms;
+    });
+    printf("%s\n", title);
+    printf("%4s  %-48s %8s %12s %7s %10s %12s\n", "rank", "name", "count", "total ms", "%", "mean ms", "mean delta");
+    for(size_t i=0; i<ranked.size(); ++i) {
+      const StageTotals& t = ranked[i];
+      printf("%4zu  %-48s %8ld %12.3f %6.1f%% %10.3f ", i+1, t.stage.c_str(), t.count, t.ms,
+             allMs > 0 ? 100.0 * t.ms / allMs : 0.0, t.ms / t.count);
+      if(t.deltas)
+        printf("%12.1f\n", (double)t.delta / t.deltas);
+      else
+        printf("%12s\n", "-");
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    if(argc != 2) {
+      fprintf(stderr, "Usage: %s <profile dir | passes.tsv>\n", argv[0]);
+      return 1;
+    }
+    std::string path = argv[1];
+    std::ifstream in(path);
+    if(!in || path.size() < 4 || path.compare(path.size() - 4, 4, ".tsv") != 0) {
+      in.close();
+      in.open(path + "/passes.tsv");
+    }
+    if(!in) {
+      fprintf(stderr, "Error reading %s\n", path.c_str());
+      return 1;
+    }
+
+    // kernel, hash, stage, ms, before, after
+    std::map<std::string, StageTotals> byStage;
+    std::map<std::string, StageTotals> byKernel;
+    std::map<std::string, bool> compiles;
+    double allMs = 0;
+    std::string line;
+    while(std::getline(in, line)) {
+      std::vector<std::string> f;
+      std::stringstream ss(line);
+      std::string field;
+      while(std::getline(ss, field, '\t'))
+        f.push_back(field);
+      if(f.size() != 6)
+        continue;
+      double ms = atof(f[3].c_str());
+      long before = atol(f[4].c_str()), after = atol(f[5].c_str());
+
+      StageTotals& s = byStage[stageKey(f[2])];
+      s.stage = stageKey(f[2]);
+      s.count++;
+      s.ms += ms;
+      if(before >= 0 && after >= 0) {
+        s.delta += after - before;
+        s.deltas++;
+      }
+
+      StageTotals& k = byKernel[f[0]];
+      k.stage = f[0];
+      if(!compiles[f[0] + "/" + f[1]]) {
+        compiles[f[0] + "/" + f[1]] = true;
+        k.count++;
+      }
+      k.ms += ms;
+      allMs += ms;
+    }
+
+    printf("%zu compiles, %.3f ms total\n\n", compiles.size(), allMs);
+    printRanking("By stage (delta: IR instructions after - before; - where not comparable)", byStage, allMs);
+    printRanking("By kernel (count: compiled variants)", byKernel, allMs);
+    return 0;
+}
@@ -0,0 +1,434 @@
+/*
+ * LD_PRELOAD shim bringing KernelFunction specialization to unmodified
+ * CUDA programs.
+ *
+ * Intercepts fat binary and kernel registration from the CUDA runtime,
+ * module loads from the driver API, and both cudaLaunchKernel and
+ * cuLaunchKernel. Kernels whose device bitcode can be found are launched
+ * through a KernelFunction; everything else is forwarded untouched to the
+ * next library providing the symbol (the real runtime/driver, or the stub
+ * in util/cuda_stub).
+ *
+ * Bitcode is taken from fat binary entries that hold LLVM bitcode, then from
+ * the files listed in GPUJIT_BITCODE (colon separated). Device libraries
+ * listed in GPUJIT_LIBRARIES are linked into every specialized kernel.
+ * Kernels in modules with host-visible __device__ or __constant__ variables
+ * are forwarded, since cudaMemcpyToSymbol and friends only reach the
+ * compiled module's copies. GPUJIT_DISABLE=1 forwards everything.
+ */
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cuda.h>
+#include <cuda_runtime_api.h>
+#include <dlfcn.h>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "KernelFunction.h"
+
+using namespace llvm;
+
+extern "C" {
+void** __cudaRegisterFatBinary(void* fatCubin);
+void __cudaRegisterFunction(void** fatCubinHandle, const char* hostFun, char* deviceFun,
+                            const char* deviceName, int thread_limit, uint3* tid,
+                            uint3* bid, dim3* bDim, dim3* gDim, int* wSize);
+}
+
+namespace {
+
+struct Bitcode {
+  const char* data;
+  size_t len;
+};
+
+struct Kernel {
+  std::string name;
+  std::vector<Bitcode> candidates;
+  KernelFunction* kf = nullptr;
+  bool resolved = false;
+  // KernelFunction is not safe to launch from several threads at once.
+  // Also guards kf and resolved.
+  std::mutex launching;
+};
+
+/*
+ * Layouts of the fat binary wrapper emitted into host objects, and of the
+ * fat binary it points to
+ */
+struct FatbinWrapper {
+  int magic;
+  int version;
+  const void* data;
+  void* filename_or_fatbins;
+};
+struct FatbinHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t headerSize;
+  uint64_t fatSize;
+};
+struct FatbinEntryHeader {
+  uint16_t kind;
+  uint16_t unknown;
+  uint32_t headerSize;
+  uint64_t payloadSize;
+};
+
+const int FATBIN_WRAPPER_MAGIC = 0x466243b1;
+const uint32_t FATBIN_MAGIC = 0xBA55ED50;
+
+// Guards the registration tables below; never held while parsing bitcode
+std::mutex lock;
+std::unordered_map<void**, std::vector<Bitcode>> fatbinBitcode;
+std::unordered_map<const void*, Kernel> hostKernels;
+std::unordered_map<CUmodule, std::vector<Bitcode>> moduleBitcode;
+std::unordered_map<CUfunction, Kernel> driverKernels;
+
+/*
+ * Set while a routed launch runs, so the JIT's own driver calls pass through
+ */
+thread_local bool inJIT = false;
+struct JITScope {
+  JITScope() { inJIT = true; }
+  ~JITScope() { inJIT = false; }
+};
+
+bool disabled() {
+  static bool d = getenv("GPUJIT_DISABLE") && strcmp(getenv("GPUJIT_DISABLE"), "0") != 0;
+  return d;
+}
+
+void* nextSymbol(const char* name) {
+  void* sym = dlsym(RTLD_NEXT, name);
+  if(!sym)
+    errs() << "gpujit: no underlying " << name << " to forward to\n";
+  return sym;
+}
+
+bool isBitcode(const char* p, size_t len) {
+  const unsigned char* u = (const unsigned char*)p;
+  if(len < 4)
+    return false;
+  // Raw bitcode, or the bitcode wrapper header
+  return (u[0] == 'B' && u[1] == 'C' && u[2] == 0xC0 && u[3] == 0xDE) ||
+         (u[0] == 0xDE && u[1] == 0xC0 && u[2] == 0x17 && u[3] == 0x0B);
+}
+
+/*
+ * Collect every fat binary entry whose payload is LLVM bitcode
+ */
+void scanFatbin(const void* image, std::vector<Bitcode>& out) {
+  if(!image)
+    return;
+  auto wrapper = (const FatbinWrapper*)image;
+  if(wrapper->magic == FATBIN_WRAPPER_MAGIC)
+    image = wrapper->data;
+  auto header = (const FatbinHeader*)image;
+  if(!image || header->magic != FATBIN_MAGIC)
+    return;
+  const char* entry = (const char*)image + header->headerSize;
+  const char* end = entry + header->fatSize;
+  while(entry + sizeof(FatbinEntryHeader) <= end) {
+    auto eh = (const FatbinEntryHeader*)entry;
+    if(eh->headerSize == 0)
+      break;
+    const char* payload = entry + eh->headerSize;
+    if(payload + eh->payloadSize > end)
+      break;
+    if(isBitcode(payload, eh->payloadSize))
+      out.push_back(Bitcode{payload, eh->payloadSize});
+    entry = payload + eh->payloadSize;
+  }
+}
+
+/*
+ * The paths in a colon-separated environment variable
+ */
+std::vector<std::string> envPaths(const char* var) {
+  std::vector<std::string> out;
+  const char* list = getenv(var);
+  if(!list)
+    return out;
+  std::string paths = list;
+  size_t pos = 0;
+  while(pos <= paths.size()) {
+    size_t colon = paths.find(':', pos);
+    if(colon == std::string::npos)
+      colon = paths.size();
+    if(colon > pos)
+      out.push_back(paths.substr(pos, colon - pos));
+    pos = colon + 1;
+  }
+  return out;
+}
+
+const std::vector<Bitcode>& sidecarBitcode() {
+  static std::vector<Bitcode> files = [] {
+    std::vector<Bitcode> files;
+    std::vector<std::string> paths = envPaths("GPUJIT_BITCODE");
+    for(auto p=paths.begin(),e=paths.end(); p!=e; ++p) {
+      const std::string& path = *p;
+      std::ifstream in(path, std::ios::binary);
+      std::string* contents = new std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+      if(!isBitcode(contents->data(), contents->size())) {
+        errs() << "gpujit: " << path << " is not LLVM bitcode, ignoring\n";
+        delete contents;
+        continue;
+      }
+      // Kept for the life of the process, like the fat binaries
+      files.push_back(Bitcode{contents->data(), contents->size()});
+    }
+    return files;
+  }();
+  return files;
+}
+
+/*
+ * The GPUJIT_LIBRARIES modules, parsed once and shared by every kernel.
+ * KernelFunction serializes the parsing with its compiles.
+ */
+const std::vector<std::shared_ptr<const Module>>& envLibraries() {
+  static std::vector<std::shared_ptr<const Module>> libs = [] {
+    std::vector<std::shared_ptr<const Module>> libs;
+    std::vector<std::string> paths = envPaths("GPUJIT_LIBRARIES");
+    for(auto p=paths.begin(),e=paths.end(); p!=e; ++p) {
+      if(auto lib = KernelFunction::parseLibraryFile(*p))
+        libs.push_back(lib);
+    }
+    return libs;
+  }();
+  return libs;
+}
+
+/*
+ * True if M has __device__ or __constant__ variables the host can reach.
+ * The runtime registers those against the compiled module, so host symbol
+ * copies would never reach the JIT's separate copies of them.
+ */
+bool hasHostVisibleGlobals(const Module& M) {
+  for(auto g=M.global_begin(),e=M.global_end(); g!=e; ++g) {
+    unsigned AS = g->getType()->getAddressSpace();
+    if((AS == 1 || AS == 4) && !g->hasLocalLinkage())
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Build the KernelFunction for k from the first bitcode that defines it.
+ * Call with k.launching held.
+ */
+KernelFunction* resolve(Kernel& k) {
+  if(k.resolved)
+    return k.kf;
+  k.resolved = true;
+  std::string name;
+  std::vector<Bitcode> candidates;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    name = k.name;
+    candidates = k.candidates;
+  }
+  const std::vector<Bitcode>& sidecar = sidecarBitcode();
+  candidates.insert(candidates.end(), sidecar.begin(), sidecar.end());
+  for(auto b=candidates.begin(),e=candidates.end(); b!=e; ++b) {
+    KernelFunction* kf = new KernelFunction((void*)b->data, b->len, name);
+    if(kf->hasKernel() && hasHostVisibleGlobals(kf->getModule())) {
+      errs() << "gpujit: " << name << " uses device globals visible to the host, launching as compiled\n";
+      delete kf;
+      return nullptr;
+    }
+    if(kf->hasKernel()) {
+      errs() << "gpujit: specializing " << name << "\n";
+      const std::vector<std::shared_ptr<const Module>>& libs = envLibraries();
+      for(auto l=libs.begin(),le=libs.end(); l!=le; ++l)
+        kf->addLibrary(*l);
+      k.kf = kf;
+      return kf;
+    }
+    delete kf;
+  }
+  errs() << "gpujit: no bitcode for " << name << ", launching as compiled\n";
+  return nullptr;
+}
+
+/*
+ * The KernelFunction to launch kernel through, with its launch lock moved
+ * into held; nullptr when the launch should be forwarded
+ */
+KernelFunction* acquire(Kernel* kernel, std::unique_lock<std::mutex>& held) {
+  if(!kernel)
+    return nullptr;
+  std::unique_lock<std::mutex> guard(kernel->launching);
+  KernelFunction* kf = resolve(*kernel);
+  if(!kf || !kf->isLaunchable())
+    return nullptr;
+  held = std::move(guard);
+  return kf;
+}
+
+}
+
+extern "C" {
+
+/*
+ * CUDA runtime registration and launch
+ */
+void** __cudaRegisterFatBinary(void* fatCubin) {
+  static auto next = (decltype(&__cudaRegisterFatBinary)) nextSymbol("__cudaRegisterFatBinary");
+  if(!next)
+    return nullptr;
+  void** handle = next(fatCubin);
+  if(disabled())
+    return handle;
+  std::vector<Bitcode> found;
+  scanFatbin(fatCubin, found);
+  std::lock_guard<std::mutex> guard(lock);
+  fatbinBitcode[handle] = found;
+  return handle;
+}
+
+void __cudaRegisterFunction(void** fatCubinHandle, const char* hostFun, char* deviceFun,
+                            const char* deviceName, int thread_limit, uint3* tid,
+                            uint3* bid, dim3* bDim, dim3* gDim, int* wSize) {
+  static auto next = (decltype(&__cudaRegisterFunction)) nextSymbol("__cudaRegisterFunction");
+  if(next)
+    next(fatCubinHandle, hostFun, deviceFun, deviceName, thread_limit, tid, bid, bDim, gDim, wSize);
+  if(disabled())
+    return;
+  std::lock_guard<std::mutex> guard(lock);
+  Kernel& k = hostKernels[hostFun];
+  k.name = deviceName;
+  k.candidates = fatbinBitcode[fatCubinHandle];
+}
+
+cudaError_t cudaLaunchKernel(const void* func, dim3 gridDim, dim3 blockDim, void** args, size_t sharedMem, cudaStream_t stream) {
+  static auto next = (decltype(&cudaLaunchKernel)) nextSymbol("cudaLaunchKernel");
+  Kernel* kernel = nullptr;
+  if(!disabled() && !inJIT) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto k = hostKernels.find(func);
+    if(k != hostKernels.end())
+      kernel = &k->second;
+  }
+  std::unique_lock<std::mutex> launching;
+  KernelFunction* kf = acquire(kernel, launching);
+  if(!kf)
+    return next ? next(func, gridDim, blockDim, args, sharedMem, stream) : cudaErrorUnknown;
+
+  CUresult err;
+  {
+    JITScope scope;
+    err = kf->launchKernel(gridDim.x, gridDim.y, gridDim.z, blockDim.x, blockDim.y, blockDim.z,
+                           sharedMem, (CUstream)stream, args);
+  }
+  // Nothing could be compiled, so nothing was launched: use the original
+  if(!kf->isLaunchable())
+    return next ? next(func, gridDim, blockDim, args, sharedMem, stream) : cudaErrorUnknown;
+  return err == CUDA_SUCCESS ? cudaSuccess : cudaErrorLaunchFailure;
+}
+
+/*
+ * CUDA driver module loading and launch
+ */
+static void recordModule(CUresult err, CUmodule* module, const void* image) {
+  if(err != CUDA_SUCCESS || disabled() || inJIT)
+    return;
+  std::vector<Bitcode> found;
+  scanFatbin(image, found);
+  if(found.empty())
+    return;
+  std::lock_guard<std::mutex> guard(lock);
+  moduleBitcode[*module] = found;
+}
+
+CUresult cuModuleLoadData(CUmodule* module, const void* image) {
+  static auto next = (decltype(&cuModuleLoadData)) nextSymbol("cuModuleLoadData");
+  if(!next)
+    return CUDA_ERROR_NOT_INITIALIZED;
+  CUresult err = next(module, image);
+  recordModule(err, module, image);
+  return err;
+}
+
+CUresult cuModuleLoadDataEx(CUmodule* module, const void* image, unsigned int numOptions, CUjit_option* options, void** optionValues) {
+  static auto next = (decltype(&cuModuleLoadDataEx)) nextSymbol("cuModuleLoadDataEx");
+  if(!next)
+    return CUDA_ERROR_NOT_INITIALIZED;
+  CUresult err = next(module, image, numOptions, options, optionValues);
+  recordModule(err, module, image);
+  return err;
+}
+
+CUresult cuModuleLoadFatBinary(CUmodule* module, const void* fatCubin) {
+  static auto next = (decltype(&cuModuleLoadFatBinary)) nextSymbol("cuModuleLoadFatBinary");
+  if(!next)
+    return CUDA_ERROR_NOT_INITIALIZED;
+  CUresult err = next(module, fatCubin);
+  recordModule(err, module, fatCubin);
+  return err;
+}
+
+CUresult cuModuleGetFunction(CUfunction* hfunc, CUmodule hmod, const char* name) {
+  static auto next = (decltype(&cuModuleGetFunction)) nextSymbol("cuModuleGetFunction");
+  if(!next)
+    return CUDA_ERROR_NOT_INITIALIZED;
+  CUresult err = next(hfunc, hmod, name);
+  if(err != CUDA_SUCCESS || disabled() || inJIT)
+    return err;
+  std::lock_guard<std::mutex> guard(lock);
+  auto m = moduleBitcode.find(hmod);
+  if(m != moduleBitcode.end()) {
+    Kernel& k = driverKernels[*hfunc];
+    k.name = name;
+    k.candidates = m->second;
+  }
+  return err;
+}
+
+CUresult cuLaunchKernel(CUfunction f,
+                        unsigned int gridDimX, unsigned int gridDimY, unsigned int gridDimZ,
+                        unsigned int blockDimX, unsigned int blockDimY, unsigned int blockDimZ,
+                        unsigned int sharedMemBytes, CUstream hStream,
+                        void** kernelParams, void** extra) {
+  static auto next = (decltype(&cuLaunchKernel)) nextSymbol("cuLaunchKernel");
+  Kernel* kernel = nullptr;
+  // Packed "extra" arguments can't be handed to launchKernel
+  if(!disabled() && !inJIT && kernelParams && !extra) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto k = driverKernels.find(f);
+    if(k != driverKernels.end())
+      kernel = &k->second;
+  }
+  std::unique_lock<std::mutex> launching;
+  KernelFunction* kf = acquire(kernel, launching);
+  if(!kf) {
+    if(!next)
+      return CUDA_ERROR_NOT_INITIALIZED;
+    return next(f, gridDimX, gridDimY, gridDimZ, blockDimX, blockDimY, blockDimZ,
+                sharedMemBytes, hStream, kernelParams, extra);
+  }
+
+  CUresult err;
+  {
+    JITScope scope;
+    err = kf->launchKernel(gridDimX, gridDimY, gridDimZ, blockDimX, blockDimY, blockDimZ,
+                           sharedMemBytes, hStream, kernelParams);
+  }
+  // Nothing could be compiled, so nothing was launched: use the original
+  if(!kf->isLaunchable())
+    return next(f, gridDimX, gridDimY, gridDimZ, blockDimX, blockDimY, blockDimZ,
+                sharedMemBytes, hStream, kernelParams, extra);
+  return err;
+}
+
+}
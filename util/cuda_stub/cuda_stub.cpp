@@ -0,0 +1,192 @@
+/*
+ * Stand-in for the CUDA driver, for exercising the JIT without a GPU.
+ *
+ * Implements the driver entry points KernelFunction uses, plus the runtime
+ * registration and launch entry points that nvcc/clang host code calls, so
+ * both the JIT and the interposition library can run against it. Modules
+ * are accepted without validation and launches only bump a counter.
+ * Set CUDA_STUB_VERBOSE=1 to log each call to stderr.
+ */
+#include <cuda.h>
+#include <cuda_runtime_api.h>
+
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+struct CUctx_st { int device; };
+struct CUmod_st { std::string image; };
+struct CUfunc_st { CUmod_st* module; std::string name; };
+
+static CUctx_st primaryCtx = {0};
+static thread_local CUcontext currentCtx = nullptr;
+static std::atomic<unsigned long> launches(0);
+static std::atomic<unsigned long> modules(0);
+
+static bool verbose() {
+    static bool v = getenv("CUDA_STUB_VERBOSE") != nullptr;
+    return v;
+}
+
+static void trace(const char* call, const char* detail) {
+    if(verbose())
+      fprintf(stderr, "cuda_stub: %s %s\n", call, detail ? detail : "");
+}
+
+static int envInt(const char* name, int fallback) {
+    const char* v = getenv(name);
+    return v ? atoi(v) : fallback;
+}
+
+extern "C" {
+
+/*
+ * Counters for harnesses that link against the stub directly
+ */
+unsigned long cudaStubLaunchCount() { return launches; }
+unsigned long cudaStubModuleCount() { return modules; }
+
+CUresult cuInit(unsigned int flags) {
+    trace("cuInit", nullptr);
+    return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetCount(int* count) {
+    *count = 1;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGet(CUdevice* device, int ordinal) {
+    if(ordinal != 0)
+      return CUDA_ERROR_INVALID_DEVICE;
+    *device = 0;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetAttribute(int* value, CUdevice_attribute attrib, CUdevice dev) {
+    // Pretend to be a mid-size sm_60 part unless told otherwise
+    switch(attrib) {
+      case CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT:
+        *value = envInt("CUDA_STUB_SM_COUNT", 28);
+        break;
+      case CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR:
+        *value = envInt("CUDA_STUB_CC_MAJOR", 6);
+        break;
+      case CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR:
+        *value = envInt("CUDA_STUB_CC_MINOR", 0);
+        break;
+      default:
+        *value = 0;
+        break;
+    }
+    return CUDA_SUCCESS;
+}
+
+CUresult cuDevicePrimaryCtxRetain(CUcontext* pctx, CUdevice dev) {
+    *pctx = &primaryCtx;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuCtxPushCurrent(CUcontext ctx) {
+    currentCtx = ctx;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuCtxGetCurrent(CUcontext* pctx) {
+    *pctx = currentCtx;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuCtxSynchronize() {
+    return CUDA_SUCCESS;
+}
+
+CUresult cuStreamSynchronize(CUstream stream) {
+    return CUDA_SUCCESS;
+}
+
+CUresult cuModuleLoadData(CUmodule* module, const void* image) {
+    if(!image)
+      return CUDA_ERROR_INVALID_VALUE;
+    trace("cuModuleLoadData", nullptr);
+    CUmod_st* m = new CUmod_st;
+    // PTX is NUL-terminated; binary images are only kept by address
+    const char* text = (const char*)image;
+    if(strncmp(text, "//", 2) == 0 || strncmp(text, ".version", 8) == 0)
+      m->image = text;
+    *module = m;
+    modules++;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuModuleLoadDataEx(CUmodule* module, const void* image, unsigned int numOptions, CUjit_option* options, void** optionValues) {
+    return cuModuleLoadData(module, image);
+}
+
+CUresult cuModuleLoadFatBinary(CUmodule* module, const void* fatCubin) {
+    return cuModuleLoadData(module, fatCubin);
+}
+
+CUresult cuModuleUnload(CUmodule module) {
+    delete module;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuModuleGetFunction(CUfunction* hfunc, CUmodule hmod, const char* name) {
+    if(!hmod || !name)
+      return CUDA_ERROR_INVALID_VALUE;
+    trace("cuModuleGetFunction", name);
+    // PTX images can be checked for the entry; anything else is trusted
+    if(!hmod->image.empty() && hmod->image.find(std::string(".entry ") + name) == std::string::npos)
+      return CUDA_ERROR_NOT_FOUND;
+    *hfunc = new CUfunc_st{hmod, name};
+    return CUDA_SUCCESS;
+}
+
+CUresult cuLaunchKernel(CUfunction f,
+                        unsigned int gridDimX, unsigned int gridDimY, unsigned int gridDimZ,
+                        unsigned int blockDimX, unsigned int blockDimY, unsigned int blockDimZ,
+                        unsigned int sharedMemBytes, CUstream hStream,
+                        void** kernelParams, void** extra) {
+    if(!f)
+      return CUDA_ERROR_INVALID_HANDLE;
+    if(verbose())
+      fprintf(stderr, "cuda_stub: cuLaunchKernel %s <<<(%u,%u,%u),(%u,%u,%u)>>>\n", f->name.c_str(),
+              gridDimX, gridDimY, gridDimZ, blockDimX, blockDimY, blockDimZ);
+    launches++;
+    return CUDA_SUCCESS;
+}
+
+/*
+ * Runtime API: enough for host code emitted by nvcc or clang to register
+ * and launch its kernels
+ */
+void** __cudaRegisterFatBinary(void* fatCubin) {
+    trace("__cudaRegisterFatBinary", nullptr);
+    return new void*(fatCubin);
+}
+
+void __cudaRegisterFatBinaryEnd(void** fatCubinHandle) {
+}
+
+void __cudaUnregisterFatBinary(void** fatCubinHandle) {
+    delete fatCubinHandle;
+}
+
+void __cudaRegisterFunction(void** fatCubinHandle, const char* hostFun, char* deviceFun,
+                            const char* deviceName, int thread_limit, uint3* tid,
+                            uint3* bid, dim3* bDim, dim3* gDim, int* wSize) {
+    trace("__cudaRegisterFunction", deviceName);
+}
+
+cudaError_t cudaLaunchKernel(const void* func, dim3 gridDim, dim3 blockDim, void** args, size_t sharedMem, cudaStream_t stream) {
+    if(verbose())
+      fprintf(stderr, "cuda_stub: cudaLaunchKernel %p <<<(%u,%u,%u),(%u,%u,%u)>>>\n", func,
+              gridDim.x, gridDim.y, gridDim.z, blockDim.x, blockDim.y, blockDim.z);
+    launches++;
+    return cudaSuccess;
+}
+
+}